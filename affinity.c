@@ -0,0 +1,126 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <affinity.h>
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+static int worker_cpus[CPU_SETSIZE];
+static int nworker_cpus;
+
+/* Where the process may run, before anything was pinned */
+static cpu_set_t allowed;
+static int allowed_ok;
+
+int
+affinity_set_workers(const char *list)
+{
+	const char *p = list;
+
+	if (!allowed_ok) {
+		if (sched_getaffinity(0, sizeof(allowed), &allowed)) return -1;
+		allowed_ok = 1;
+	}
+
+	nworker_cpus = 0;
+	while (*p) {
+		char *end;
+		long lo, hi, c;
+
+		lo = strtol(p, &end, 10);
+		if (end == p) return -1;
+		hi = lo;
+		if (*end == '-') {
+			p  = end + 1;
+			hi = strtol(p, &end, 10);
+			if (end == p) return -1;
+		}
+		if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) return -1;
+
+		for (c = lo; c <= hi; c++) {
+			if (!CPU_ISSET(c, &allowed) || nworker_cpus == CPU_SETSIZE) return -1;
+			worker_cpus[nworker_cpus++] = c;
+		}
+		if (*end == ',') end++;
+		else if (*end) return -1;
+		p = end;
+	}
+	return nworker_cpus ? 0 : -1;
+}
+
+int
+affinity_nworkers(void)
+{
+	return nworker_cpus;
+}
+
+int
+affinity_pin(int cpu)
+{
+	cpu_set_t set;
+
+	if (!allowed_ok) {
+		if (sched_getaffinity(0, sizeof(allowed), &allowed)) return -1;
+		allowed_ok = 1;
+	}
+	if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) return -1;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) ? -1 : 0;
+}
+
+int
+affinity_pin_worker(int i)
+{
+	int cpu;
+
+	if (!nworker_cpus) {
+		if (allowed_ok) pthread_setaffinity_np(pthread_self(), sizeof(allowed), &allowed);
+		return -1;
+	}
+	cpu = worker_cpus[i % nworker_cpus];
+	return affinity_pin(cpu) ? -1 : cpu;
+}
+
+int
+affinity_worker_on(int cpu)
+{
+	int i;
+
+	if (cpu < 0) return -1;
+	for (i = 0; i < nworker_cpus; i++) {
+		if (worker_cpus[i] == cpu) return i;
+	}
+	return -1;
+}
+
+int
+affinity_incoming_cpu(int fd)
+{
+	socklen_t len = sizeof(int);
+	int cpu;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len)) return -1;
+	return cpu;
+}
+
+int
+affinity_steer(int accept_fd, int cpu)
+{
+	return setsockopt(accept_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+}
@@ -0,0 +1,56 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+/*
+ * Pinning threads to CPUs.  Workers are given the CPUs of a list in
+ * turn, and the acceptor a CPU of its own.  Memory needs no special
+ * placement: what a worker uses most (its request and connection
+ * pools, its stats block, its buffers) it allocates and touches
+ * first itself, so once it is pinned the kernel's default policy
+ * puts that memory on the worker's own NUMA node.
+ */
+
+/*
+ * Set the workers' CPUs from a list such as "0-3,8,10".  Return -1 if
+ * it isn't one, or names a CPU we may not run on.
+ */
+int affinity_set_workers(const char *list);
+
+/* The number of CPUs in the workers' list, 0 if there is none */
+int affinity_nworkers(void);
+
+/*
+ * Pin the calling thread, which is worker i, to its CPU from the list.
+ * Without a list, let it run anywhere the process may: the thread may
+ * have inherited the acceptor's CPU.  Return the CPU, or -1.
+ */
+int affinity_pin_worker(int i);
+
+/* Pin the calling thread to cpu.  Return -1 on error. */
+int affinity_pin(int cpu);
+
+/*
+ * The first worker pinned to cpu, or -1 if there is none (or cpu is
+ * -1), so connections can be handed to the worker on the core that
+ * took their interrupts.
+ */
+int affinity_worker_on(int cpu);
+
+/* The CPU that handled fd's packets (SO_INCOMING_CPU), or -1 */
+int affinity_incoming_cpu(int fd);
+
+/*
+ * Have the kernel prefer the SO_REUSEPORT listener accept_fd for
+ * connections whose packets cpu handles.  Return -1 on error.
+ */
+int affinity_steer(int accept_fd, int cpu);
+
+#endif
@@ -8,33 +8,44 @@
  * updated: the new value that will be written into target if it is == cmp.
  * return : 0 on successful modification.  !0 otherwise.
  * 
+ * The operation is the full width of an unsigned long (cmpxchgq on
+ * x86-64, cmpxchgl on i386), and acts as a full memory barrier.
+ * 
  * Usage
  * -----
  * 
  * Global:
- * volatile int var = 0;
+ * volatile unsigned long var = 0;
  *
  * In function:
- * int new_var, old_var;
+ * unsigned long new_var, old_var;
  * do {
  *     old_var = var;
  *     new_var = var;
  *     new_var++;
- * } while (__cas(&var, old_var, new_var));
+ * } while (__cas((unsigned long *)&var, old_var, new_var));
  * 
  * Now, we know that var is set to new_var.
  */
 static inline int 
 __cas(unsigned long *target, unsigned long cmp, unsigned long updated)
 {
+#if defined(__x86_64__) || defined(__i386__)
 	char z;
-	__asm__ __volatile__("lock cmpxchgl %2, %0; setz %1"
+	/* 
+	 * No size suffix: the assembler picks it from the register
+	 * holding updated, which is the width of unsigned long.
+	 */
+	__asm__ __volatile__("lock cmpxchg %3, %0; setz %1"
 			     : "+m" (*target),
-			       "=a" (z)
-			     : "q"  (updated),
-			       "a"  (cmp)
+			       "=q" (z),
+			       "+a" (cmp)
+			     : "r"  (updated)
 			     : "memory", "cc");
 	return (int)!z;
+#else
+	return !__sync_bool_compare_and_swap(target, cmp, updated);
+#endif
 }
 
 #endif
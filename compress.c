@@ -0,0 +1,229 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <limits.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#include <content.h>
+#include <compress.h>
+
+/* Smaller files gain too little to be worth a variant */
+#define COMPRESS_MIN_SZ     256
+/* A variant has to save at least 1/COMPRESS_MIN_SAVING of the file */
+#define COMPRESS_MIN_SAVING 8
+/*
+ * We compress once per file version, off of the request path, so we
+ * can afford the strongest gzip.  Brotli's top qualities are slower
+ * by another order of magnitude for little gain, though.
+ */
+#define GZIP_LEVEL          9
+#define BROTLI_QUALITY      9
+
+static const struct {
+	const char *name, *alias, *suffix;
+} codings[ENC_MAX] = {
+	[ENC_IDENTITY] = { "identity", NULL,     ""    },
+	[ENC_BR]       = { "br",       NULL,     ".br" },
+	[ENC_GZIP]     = { "gzip",     "x-gzip", ".gz" },
+};
+
+const char *
+compress_name(encoding_t enc)
+{
+	return codings[enc].name;
+}
+
+/* Is the q value in [p, end) zero, i.e. "0", "0.", "0.0"...? */
+static int
+q_zero(char *p, char *end)
+{
+	while (p < end && *p == ' ') p++;
+	if (p == end || *p++ != '0') return 0;
+	if (p < end && *p == '.') p++;
+	while (p < end && *p == '0') p++;
+	while (p < end && (*p == ' ' || *p == '\t')) p++;
+
+	return p == end;
+}
+
+/*
+ * Accept-Encoding is a list of codings, each with an optional weight:
+ * "gzip, br;q=0.8, *;q=0".  We only care whether a weight is zero, and
+ * otherwise serve the coding we prefer.
+ */
+int
+compress_accepted(struct http_req *r, encoding_t encs[ENC_MAX])
+{
+	struct shttp_str *ae = &r->head.accept_encoding;
+	int allowed[ENC_MAX], star = 0, n = 0, i = 0;
+	encoding_t e;
+
+	if (!ae->p) return 0;
+	for (e = 0; e < ENC_MAX; e++) allowed[e] = -1;
+
+	while (i < ae->len) {
+		int start, end, semi;
+		int ok;
+
+		while (i < ae->len && (ae->p[i] == ' ' || ae->p[i] == '\t')) i++;
+		start = i;
+		while (i < ae->len && ae->p[i] != ',') i++;
+		end = i++;
+
+		/* the coding, and its weight */
+		for (semi = start; semi < end && ae->p[semi] != ';'; semi++) ;
+		ok = 1;
+		if (semi < end) {
+			char *q = ae->p + semi + 1;
+
+			while (q < ae->p + end && *q == ' ') q++;
+			if (ae->p + end - q > 2 && !strncasecmp(q, "q=", 2)) {
+				ok = !q_zero(q + 2, ae->p + end);
+			}
+		}
+		while (semi > start && (ae->p[semi - 1] == ' ' || ae->p[semi - 1] == '\t')) semi--;
+
+		if (semi - start == 1 && ae->p[start] == '*') {
+			star = ok;
+			continue;
+		}
+		for (e = ENC_IDENTITY + 1; e < ENC_MAX; e++) {
+			const char *a = codings[e].alias;
+
+			if ((semi - start == (int)strlen(codings[e].name) &&
+			     !strncasecmp(ae->p + start, codings[e].name, semi - start)) ||
+			    (a && semi - start == (int)strlen(a) &&
+			     !strncasecmp(ae->p + start, a, semi - start))) {
+				allowed[e] = ok;
+			}
+		}
+	}
+
+	for (e = ENC_IDENTITY + 1; e < ENC_MAX; e++) {
+		if (allowed[e] == 1 || (allowed[e] == -1 && star)) encs[n++] = e;
+	}
+	return n;
+}
+
+static char *
+gzip_buf(char *data, int len, int *out_len)
+{
+	z_stream z;
+	char *out;
+	uLong bound;
+
+	memset(&z, 0, sizeof(z_stream));
+	/* 15 bits of window, plus 16 for a gzip (rather than zlib) wrapper */
+	if (deflateInit2(&z, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return NULL;
+	}
+	bound = deflateBound(&z, len);
+	out   = malloc(bound);
+	if (!out) goto err;
+
+	z.next_in   = (Bytef *)data;
+	z.avail_in  = len;
+	z.next_out  = (Bytef *)out;
+	z.avail_out = bound;
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END) goto err;
+	*out_len = z.total_out;
+	deflateEnd(&z);
+
+	return out;
+err:
+	free(out);
+	deflateEnd(&z);
+	return NULL;
+}
+
+static char *
+brotli_buf(char *data, int len, int *out_len)
+{
+	size_t n = BrotliEncoderMaxCompressedSize(len);
+	char *out;
+
+	if (!n) return NULL;
+	out = malloc(n);
+	if (!out) return NULL;
+
+	if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC,
+				   len, (uint8_t *)data, &n, (uint8_t *)out)) {
+		free(out);
+		return NULL;
+	}
+	*out_len = n;
+
+	return out;
+}
+
+/* Is a no newer than b? */
+static int
+mtime_le(struct stat *a, struct stat *b)
+{
+	if (a->st_mtim.tv_sec != b->st_mtim.tv_sec) return a->st_mtim.tv_sec < b->st_mtim.tv_sec;
+	return a->st_mtim.tv_nsec <= b->st_mtim.tv_nsec;
+}
+
+char *
+compress_file(char *path, encoding_t enc, int max_len, int *len, struct stat *st)
+{
+	char sibling[PATH_MAX], *data, *out;
+	struct stat sst;
+	int dlen;
+
+	if (enc <= ENC_IDENTITY || enc >= ENC_MAX) return NULL;
+	if (content_stat(path, st)) return NULL;
+
+	/* precompressed by whoever published the file */
+	if (snprintf(sibling, PATH_MAX, "%s%s", path, codings[enc].suffix) < PATH_MAX) {
+		data = content_read(sibling, max_len, len, &sst);
+		if (data && mtime_le(st, &sst)) return data;
+		free(data);
+	}
+
+	data = content_read(path, max_len, &dlen, st);
+	if (!data) return NULL;
+	if (dlen < COMPRESS_MIN_SZ) {
+		free(data);
+		return NULL;
+	}
+
+	if (enc == ENC_GZIP) out = gzip_buf(data, dlen, len);
+	else                 out = brotli_buf(data, dlen, len);
+	free(data);
+
+	/* e.g. images, which are compressed already */
+	if (out && *len > dlen - dlen / COMPRESS_MIN_SAVING) {
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+
+void
+compress_validator(struct shttp_validator *v, struct stat *st, encoding_t enc)
+{
+	const char *suffix = codings[enc].suffix;
+	int n = strlen(suffix);
+
+	shttp_validator(v, st);
+	if (enc == ENC_IDENTITY || v->etag_len + n >= SHTTP_ETAG_SZ) return;
+
+	/* "...-1f3e" becomes "...-1f3e-gz": each variant has its own ETag */
+	v->etag[v->etag_len - 1] = '-';
+	memcpy(v->etag + v->etag_len, suffix + 1, n - 1);
+	v->etag_len += n - 1;
+	v->etag[v->etag_len++] = '"';
+	v->etag[v->etag_len]   = '\0';
+}
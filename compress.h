@@ -0,0 +1,47 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <sys/stat.h>
+
+#include <simple_http.h>
+
+/* Content codings, in the order we prefer them */
+typedef enum {
+	ENC_IDENTITY = 0,
+	ENC_BR,
+	ENC_GZIP,
+	ENC_MAX
+} encoding_t;
+
+/* The name of the coding, as in Content-Encoding */
+const char *compress_name(encoding_t enc);
+
+/*
+ * Fill encs with the codings (other than identity) the Accept-Encoding
+ * header of r allows, most preferred first, and return how many.
+ */
+int compress_accepted(struct http_req *r, encoding_t encs[ENC_MAX]);
+
+/*
+ * Produce the enc coded variant of the file at path, of at most
+ * max_len bytes: read from a sibling file (path.gz, path.br) if there
+ * is one at least as new as the file, and otherwise compressed here.
+ * This is slow, and meant for a background thread.  st is set to the
+ * stat of the file itself.  Return the variant, which the caller must
+ * free, or NULL if there is no such file, or it doesn't compress well
+ * enough to be worth it.
+ */
+char *compress_file(char *path, encoding_t enc, int max_len, int *len, struct stat *st);
+
+/* The validator of the enc coded variant of the file with stat st */
+void compress_validator(struct shttp_validator *v, struct stat *st, encoding_t enc);
+
+#endif
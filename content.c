@@ -16,20 +16,16 @@
 #include <fcntl.h>
 #include <unistd.h>
 
-/* 10 MB is max size */
-#define MAX_CONTENT_SZ (1024*1024*10)
+#include <content.h>
 
-char *
-error_resp(char *path, int *len)
+static const char eresponse[] = "<html><head><title>X-P</title></head><body><font face=\"sans-serif\"><center><h1>X-P</h1><p>Could not find content at <b>%s</b>.</p></font></center></body>";
+
+int
+content_error(char *path, char *buf, int sz)
 {
-	const char eresponse[] = "<html><head><title>X-P</title></head><body><font face=\"sans-serif\"><center><h1>X-P</h1><p>Could not find content at <b>%s</b>.</p></font></center></body>";
-	char *resp;
-	int sz = strlen(eresponse) + strlen(path);
-	
-	resp = malloc(sz);
-	if (!resp) return NULL;
-	*len = sprintf(resp, eresponse, path);
-	return resp;
+	int len = snprintf(buf, sz, eresponse, path);
+
+	return len < sz ? len : sz - 1;
 }
 
 int
@@ -37,35 +33,31 @@ sanity_check(char *path)
 { return (path[0] == '.' || path[0] == '/'); }
 
 char *
-content_get(char *path, int *content_len)
+content_read(char *path, int max_len, int *content_len, struct stat *s)
 {
 	char *resp;
 	int content_fd, amnt_read = 0;
-	struct stat s;
-
-#ifdef THINK_TIME
-	sleep(1);
-#endif
 
 	/* Bad path?  No file?  Too large? */
 	if (sanity_check(path) || 
-	    stat(path, &s)     ||
-	    s.st_size > MAX_CONTENT_SZ) goto err;
+	    stat(path, s)      ||
+	    s->st_size > max_len) goto err;
 
 	content_fd = open(path, O_RDONLY);
 	if (content_fd < 0) goto err;
 
-	resp = malloc(s.st_size);
+	resp = malloc(s->st_size);
 	if (!resp) goto err_close;
 
-	while (amnt_read < s.st_size) {
+	while (amnt_read < s->st_size) {
 		int ret = read(content_fd, resp + amnt_read, 
-			       s.st_size - amnt_read);
+			       s->st_size - amnt_read);
 
-		if (ret < 0) goto err_free;
+		if (ret <= 0) goto err_free;
 		amnt_read += ret;
 	}
-	*content_len = s.st_size;
+	close(content_fd);
+	*content_len = s->st_size;
 
 	return resp;
 err_free:
@@ -73,5 +65,40 @@ err_free:
 err_close:
 	close(content_fd);
 err:
-	return error_resp(path, content_len);
+	return NULL;
+}
+
+int
+content_open(char *path, int *content_fd, off_t *content_len, struct stat *s)
+{
+	int fd;
+
+#ifdef THINK_TIME
+	sleep(1);
+#endif
+
+	if (sanity_check(path)) return -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+
+	/* fstat the file we opened, rather than whatever is at path now */
+	if (fstat(fd, s) || !S_ISREG(s->st_mode)) {
+		close(fd);
+		return -1;
+	}
+	*content_fd  = fd;
+	*content_len = s->st_size;
+
+	return 0;
+}
+
+int
+content_stat(char *path, struct stat *s)
+{
+	if (sanity_check(path) ||
+	    stat(path, s)      ||
+	    !S_ISREG(s->st_mode)) return -1;
+
+	return 0;
 }
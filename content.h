@@ -9,11 +9,42 @@
 #ifndef CONTENT_H
 #define CONTENT_H
 
+#include <sys/stat.h>
+
+/* 
+ * 10 MB is the max size of a file read into memory.  Larger ones are
+ * only streamed from the file, by content_open.
+ */
+#define MAX_CONTENT_SZ (1024*1024*10)
+
 /* 
  * Take the path we want to read, and return the data associated with
- * that.  content_len is set to be the length of the data that is
- * returned.  The caller must free the returned string.
+ * that, for files of at most max_len bytes only: return NULL if the
+ * file can't be read.  content_len is set to be the length of the
+ * data that is returned, and s is filled in with the file's stat.
+ * The caller must free the returned string.
+ */
+char *content_read(char *path, int max_len, int *content_len, struct stat *s);
+
+/* 
+ * Open the file at path, of any size, for sending straight from the
+ * page cache, rather than reading it into memory.  On success, return
+ * 0 with content_fd set to the open file (which the caller must
+ * close), content_len to its length, and s to its stat.  Return -1 if
+ * there is no such file.
+ */
+int content_open(char *path, int *content_fd, off_t *content_len, struct stat *s);
+
+/* 
+ * Fill in s with the stat of the file at path, without opening it.
+ * Return -1 if there is no file that content_open would open.
+ */
+int content_stat(char *path, struct stat *s);
+
+/* 
+ * Format the page saying that there is nothing at path into buf (of
+ * sz bytes), and return its length.
  */
-char *content_get(char *path, int *content_len);
+int content_error(char *path, char *buf, int sz);
 
 #endif
@@ -0,0 +1,617 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <content.h>
+#include <content_cache.h>
+#include <compress.h>
+
+/*
+ * The cache is split into shards by path hash, each with its own
+ * lock, hash table, CLOCK ring and share of the size bound, so
+ * lookups of different files rarely touch the same lock.
+ */
+#define CACHE_SHARDS     16
+#define CACHE_BUCKETS    256 /* per shard */
+#define CACHE_HEAD_SZ    256
+/*
+ * A hit only re-stats the file (to compare its mtime) if it was last
+ * checked more than this many seconds ago, so most hits make no
+ * system call at all.
+ */
+#define CACHE_REVALIDATE 1
+/* Variants waiting for the compression thread; more are not made */
+#define CACHE_QUEUE_SZ   64
+
+/*
+ * Entries are keyed by path and content coding.  A coded variant
+ * without data stands in for one that is being made (pending), or
+ * that isn't worth making: either way, the file is served as is.
+ */
+struct cache_entry {
+	char               *path;
+	unsigned long       hash;
+	encoding_t          enc;
+	int                 pending;
+
+	char               *data;
+	int                 len;
+	/* response heads, indexed by keep_alive */
+	char                head[2][CACHE_HEAD_SZ];
+	int                 head_len[2];
+	struct shttp_validator valid;
+
+	/* what the file looked like when we read it */
+	struct timespec     mtime;
+	off_t               size;
+	time_t              checked;
+
+	/* the table's reference, plus one per request using it */
+	int                 refcnt;
+	int                 referenced; /* CLOCK bit, set on every hit */
+	size_t              bytes;      /* charged against the bound */
+
+	struct cache_entry *hnext;          /* hash chain */
+	struct cache_entry *cnext, *cprev;  /* CLOCK ring */
+};
+
+struct cache_shard {
+	pthread_mutex_t     lock;
+	struct cache_entry *buckets[CACHE_BUCKETS];
+	struct cache_entry *hand;
+	size_t              bytes, max_bytes;
+	unsigned long       entries;
+	unsigned long       hits, misses, stale, evictions, compressed;
+} __attribute__((aligned(64)));
+
+static struct cache_shard *shards;
+static int max_entry_sz;
+
+/* Pending variants, each holding a reference, for compress_thread */
+static struct cache_entry *queue[CACHE_QUEUE_SZ];
+static int queue_head, queue_len;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  queue_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned long
+path_hash(char *path)
+{
+	unsigned long h = 14695981039346656037UL; /* FNV-1a */
+
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 1099511628211UL;
+	}
+	return h;
+}
+
+static void
+entry_put(void *owner)
+{
+	struct cache_entry *e = owner;
+
+	if (__atomic_sub_fetch(&e->refcnt, 1, __ATOMIC_ACQ_REL)) return;
+	free(e->data);
+	free(e->path);
+	free(e);
+}
+
+static struct cache_entry *
+shard_find(struct cache_shard *s, unsigned long h, char *path, encoding_t enc)
+{
+	struct cache_entry *e;
+
+	for (e = s->buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS]; e; e = e->hnext) {
+		if (e->hash == h && e->enc == enc && !strcmp(e->path, path)) return e;
+	}
+	return NULL;
+}
+
+/* Add e just behind the hand, so it is the last to be looked at. */
+static void
+shard_insert(struct cache_shard *s, struct cache_entry *e)
+{
+	struct cache_entry **b = &s->buckets[(e->hash / CACHE_SHARDS) % CACHE_BUCKETS];
+
+	e->hnext = *b;
+	*b = e;
+
+	if (!s->hand) {
+		e->cnext = e->cprev = e;
+		s->hand = e;
+	} else {
+		e->cnext = s->hand;
+		e->cprev = s->hand->cprev;
+		e->cprev->cnext = e;
+		s->hand->cprev  = e;
+	}
+	s->bytes += e->bytes;
+	s->entries++;
+}
+
+/* Take e out of the shard and drop the table's reference. */
+static void
+shard_remove(struct cache_shard *s, struct cache_entry *e)
+{
+	struct cache_entry **p = &s->buckets[(e->hash / CACHE_SHARDS) % CACHE_BUCKETS];
+
+	while (*p != e) p = &(*p)->hnext;
+	*p = e->hnext;
+
+	if (e->cnext == e) {
+		s->hand = NULL;
+	} else {
+		if (s->hand == e) s->hand = e->cnext;
+		e->cprev->cnext = e->cnext;
+		e->cnext->cprev = e->cprev;
+	}
+	s->bytes -= e->bytes;
+	s->entries--;
+	entry_put(e);
+}
+
+/*
+ * CLOCK: sweep the hand over the ring, giving entries that were hit
+ * since the last sweep a second chance, until we are within bounds.
+ * Entries still in use are freed by their last reference.
+ */
+static void
+shard_evict(struct cache_shard *s)
+{
+	while (s->bytes > s->max_bytes && s->hand) {
+		struct cache_entry *e = s->hand;
+
+		if (e->referenced) {
+			e->referenced = 0;
+			s->hand = e->cnext;
+			continue;
+		}
+		shard_remove(s, e);
+		s->evictions++;
+	}
+}
+
+/* Has the file changed since we cached it? */
+static int
+entry_stale(struct cache_entry *e)
+{
+	struct stat st;
+
+	if (stat(e->path, &st)) return 1;
+	return st.st_size != e->size ||
+	       st.st_mtim.tv_sec  != e->mtime.tv_sec ||
+	       st.st_mtim.tv_nsec != e->mtime.tv_nsec;
+}
+
+/*
+ * Read the file, and add it to the shard (unless someone beat us to
+ * it).  Return the entry with a reference for the caller, or NULL.
+ */
+static struct cache_entry *
+cache_fill(struct cache_shard *s, unsigned long h, char *path)
+{
+	struct cache_entry *e, *old;
+	struct stat st;
+	char *data;
+	int len;
+
+	/* no file (or too large): don't allocate anything */
+	data = content_read(path, max_entry_sz, &len, &st);
+	if (!data) return NULL;
+
+	e = malloc(sizeof(struct cache_entry));
+	if (!e) {
+		free(data);
+		return NULL;
+	}
+	memset(e, 0, sizeof(struct cache_entry));
+	e->data = data;
+	e->len  = len;
+	e->path = strdup(path);
+	if (!e->path) goto err;
+	shttp_validator(&e->valid, &st);
+	e->head_len[0] = shttp_format_response_head(e->head[0], CACHE_HEAD_SZ, e->len, 0,
+						    &e->valid);
+	e->head_len[1] = shttp_format_response_head(e->head[1], CACHE_HEAD_SZ, e->len, 1,
+						    &e->valid);
+	if (e->head_len[0] < 0 || e->head_len[1] < 0) goto err;
+
+	e->hash       = h;
+	e->mtime      = st.st_mtim;
+	e->size       = st.st_size;
+	e->checked    = time(NULL);
+	e->refcnt     = 2;
+	e->referenced = 1;
+	e->bytes      = sizeof(struct cache_entry) + e->len + strlen(path) + 1;
+
+	pthread_mutex_lock(&s->lock);
+	old = shard_find(s, h, path, ENC_IDENTITY);
+	if (old) {
+		/* filled concurrently: use theirs */
+		__atomic_add_fetch(&old->refcnt, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&s->lock);
+		e->refcnt = 1;
+		entry_put(e);
+		return old;
+	}
+	shard_insert(s, e);
+	shard_evict(s);
+	pthread_mutex_unlock(&s->lock);
+
+	return e;
+err:
+	free(e->data);
+	free(e->path);
+	free(e);
+	return NULL;
+}
+
+/*
+ * Hand the pending variant e (and a reference to it) to the
+ * compression thread.  Return -1 if it has too much to do already.
+ */
+static int
+queue_push(struct cache_entry *e)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&queue_lock);
+	if (queue_len < CACHE_QUEUE_SZ) {
+		queue[(queue_head + queue_len++) % CACHE_QUEUE_SZ] = e;
+		pthread_cond_signal(&queue_cond);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	return ret;
+}
+
+/*
+ * Add a pending variant of path, coded as enc, to the shard, and
+ * queue it to be made.  The shard is locked.
+ */
+static void
+variant_queue(struct cache_shard *s, unsigned long h, char *path, encoding_t enc)
+{
+	struct cache_entry *e;
+
+	e = calloc(1, sizeof(struct cache_entry));
+	if (!e) return;
+	e->path = strdup(path);
+	if (!e->path) {
+		free(e);
+		return;
+	}
+	e->hash    = h;
+	e->enc     = enc;
+	e->pending = 1;
+	e->refcnt  = 2;
+	e->bytes   = sizeof(struct cache_entry) + strlen(path) + 1;
+
+	if (queue_push(e)) {
+		e->refcnt = 1;
+		entry_put(e);
+		return;
+	}
+	shard_insert(s, e);
+	shard_evict(s);
+}
+
+/*
+ * Make the variant p stands in for, and put it in p's place, unless
+ * p has been dropped meanwhile.  If the variant isn't worth having,
+ * p stays, no longer pending, until the file changes.  If there is
+ * no file, p goes: a miss on a missing path leaves nothing behind.
+ */
+static void
+variant_fill(struct cache_entry *p)
+{
+	struct cache_shard *s = &shards[p->hash % CACHE_SHARDS];
+	struct cache_entry *e = NULL;
+	struct stat st;
+	char *data;
+	int len;
+
+	memset(&st, 0, sizeof(struct stat));
+	data = compress_file(p->path, p->enc, max_entry_sz, &len, &st);
+	if (data) {
+		e = calloc(1, sizeof(struct cache_entry));
+		if (e) e->path = strdup(p->path);
+		if (!e || !e->path) {
+			free(e);
+			free(data);
+			e = NULL;
+		}
+	}
+	if (e) {
+		int i;
+
+		e->hash = p->hash;
+		e->enc  = p->enc;
+		e->data = data;
+		e->len  = len;
+		compress_validator(&e->valid, &st, e->enc);
+		for (i = 0; i < 2; i++) {
+			e->head_len[i] = shttp_format_encoded_head(e->head[i], CACHE_HEAD_SZ, e->len,
+								   i, &e->valid,
+								   compress_name(e->enc));
+		}
+		e->mtime      = st.st_mtim;
+		e->size       = st.st_size;
+		e->checked    = time(NULL);
+		e->refcnt     = 1;
+		e->referenced = 1;
+		e->bytes      = sizeof(struct cache_entry) + e->len + strlen(e->path) + 1;
+		if (e->head_len[0] < 0 || e->head_len[1] < 0) {
+			entry_put(e);
+			e = NULL;
+		}
+	}
+
+	pthread_mutex_lock(&s->lock);
+	if (shard_find(s, p->hash, p->path, p->enc) == p) {
+		if (e) {
+			shard_remove(s, p);
+			shard_insert(s, e);
+			shard_evict(s);
+			s->compressed++;
+			e = NULL;
+		} else if (!S_ISREG(st.st_mode)) {
+			shard_remove(s, p);
+		} else {
+			p->mtime   = st.st_mtim;
+			p->size    = st.st_size;
+			p->checked = time(NULL);
+			p->pending = 0;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if (e) entry_put(e);
+}
+
+/* Compression happens here, never on the threads serving requests */
+static void *
+compress_thread(void *arg)
+{
+	(void)arg;
+
+	while (1) {
+		struct cache_entry *e;
+
+		pthread_mutex_lock(&queue_lock);
+		while (!queue_len) pthread_cond_wait(&queue_cond, &queue_lock);
+		e = queue[queue_head];
+		queue_head = (queue_head + 1) % CACHE_QUEUE_SZ;
+		queue_len--;
+		pthread_mutex_unlock(&queue_lock);
+
+		variant_fill(e);
+		entry_put(e);
+	}
+	return NULL;
+}
+
+int
+content_cache_init(size_t max_bytes)
+{
+	int i;
+
+	if (max_bytes == 0) return 0;
+
+	shards = calloc(CACHE_SHARDS, sizeof(struct cache_shard));
+	if (!shards) return -1;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		shards[i].max_bytes = max_bytes / CACHE_SHARDS;
+	}
+	/* anything bigger would flush a good part of its shard */
+	max_entry_sz = max_bytes / CACHE_SHARDS / 4;
+
+	return 0;
+}
+
+int
+content_cache_start(void)
+{
+	pthread_t t;
+	int i;
+
+	if (!shards) return 0;
+
+	/* 
+	 * After a fork, the locks are in whatever state the parent's
+	 * threads left them, and the queue's references are the
+	 * parent's: start from scratch.
+	 */
+	for (i = 0; i < CACHE_SHARDS; i++) pthread_mutex_init(&shards[i].lock, NULL);
+	pthread_mutex_init(&queue_lock, NULL);
+	pthread_cond_init(&queue_cond, NULL);
+	queue_head = queue_len = 0;
+
+	if (pthread_create(&t, NULL, compress_thread, NULL)) return -1;
+	pthread_detach(t);
+
+	return 0;
+}
+
+int
+content_cache_respond_encoded(struct http_req *r)
+{
+	struct cache_shard *s;
+	struct cache_entry *e = NULL;
+	encoding_t encs[ENC_MAX];
+	unsigned long h;
+	time_t now;
+	int i, n, queued = 0;
+
+	if (!shards) return -1;
+	n = compress_accepted(r, encs);
+	if (!n) return -1;
+
+	h = path_hash(r->path);
+	s = &shards[h % CACHE_SHARDS];
+	now = time(NULL);
+
+	pthread_mutex_lock(&s->lock);
+	for (i = 0; i < n; i++) {
+		e = shard_find(s, h, r->path, encs[i]);
+		if (e && !e->pending && now - e->checked >= CACHE_REVALIDATE) {
+			if (entry_stale(e)) {
+				shard_remove(s, e);
+				s->stale++;
+				e = NULL;
+			} else {
+				e->checked = now;
+			}
+		}
+		/* 
+		 * Make the variant we'd rather serve, one per request.  Is
+		 * there a file at all?  That is for the compression thread
+		 * to find out (variant_fill): no disk work here.
+		 */
+		if (!e && !queued) {
+			variant_queue(s, h, r->path, encs[i]);
+			queued = 1;
+		}
+		if (e && e->data) break;
+		e = NULL;
+	}
+	if (e) {
+		e->referenced = 1;
+		__atomic_add_fetch(&e->refcnt, 1, __ATOMIC_RELAXED);
+		s->hits++;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if (!e) return -1;
+
+	if (shttp_conditional(r) && shttp_not_modified(r, &e->valid)) {
+		int ret = shttp_alloc_not_modified(r, &e->valid);
+
+		entry_put(e);
+		return ret;
+	}
+	r->resp_head    = e->head[r->keep_alive];
+	r->resp_hd_len  = e->head_len[r->keep_alive];
+	r->response     = e->data;
+	r->resp_len     = e->len;
+	r->resp_release = entry_put;
+	r->resp_owner   = e;
+
+	return 0;
+}
+
+/* Answer r from the cache, reading the file into it if fill is set */
+static int
+cache_respond(struct http_req *r, int fill)
+{
+	struct cache_shard *s;
+	struct cache_entry *e;
+	unsigned long h;
+	time_t now;
+
+	if (!shards) return -1;
+
+	h = path_hash(r->path);
+	s = &shards[h % CACHE_SHARDS];
+	now = time(NULL);
+
+	pthread_mutex_lock(&s->lock);
+	e = shard_find(s, h, r->path, ENC_IDENTITY);
+	if (e && now - e->checked >= CACHE_REVALIDATE) {
+		if (entry_stale(e)) {
+			shard_remove(s, e);
+			s->stale++;
+			e = NULL;
+		} else {
+			e->checked = now;
+		}
+	}
+	if (e) {
+		e->referenced = 1;
+		__atomic_add_fetch(&e->refcnt, 1, __ATOMIC_RELAXED);
+		s->hits++;
+	} else if (fill) {
+		s->misses++;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if (!e && fill) e = cache_fill(s, h, r->path);
+	if (!e) return -1;
+
+	r->resp_head    = e->head[r->keep_alive];
+	r->resp_hd_len  = e->head_len[r->keep_alive];
+	r->response     = e->data;
+	r->resp_len     = e->len;
+	r->resp_release = entry_put;
+	r->resp_owner   = e;
+
+	return 0;
+}
+
+int
+content_cache_respond(struct http_req *r)
+{
+	return cache_respond(r, 1);
+}
+
+int
+content_cache_lookup(struct http_req *r)
+{
+	return cache_respond(r, 0);
+}
+
+int
+content_cache_size(char *path, off_t *size)
+{
+	struct cache_shard *s;
+	struct cache_entry *e;
+	unsigned long h;
+
+	if (!shards) return -1;
+
+	h = path_hash(path);
+	s = &shards[h % CACHE_SHARDS];
+
+	pthread_mutex_lock(&s->lock);
+	e = shard_find(s, h, path, ENC_IDENTITY);
+	if (e) *size = e->size;
+	pthread_mutex_unlock(&s->lock);
+
+	return e ? 0 : -1;
+}
+
+void
+content_cache_stats(struct content_cache_stats *st)
+{
+	int i;
+
+	memset(st, 0, sizeof(struct content_cache_stats));
+	if (!shards) return;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *s = &shards[i];
+
+		pthread_mutex_lock(&s->lock);
+		st->hits      += s->hits;
+		st->misses    += s->misses;
+		st->stale     += s->stale;
+		st->evictions += s->evictions;
+		st->compressed += s->compressed;
+		st->bytes     += s->bytes;
+		st->entries   += s->entries;
+		pthread_mutex_unlock(&s->lock);
+	}
+}
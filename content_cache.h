@@ -0,0 +1,74 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef CONTENT_CACHE_H
+#define CONTENT_CACHE_H
+
+#include <stddef.h>
+
+#include <simple_http.h>
+
+struct content_cache_stats {
+	unsigned long hits;      /* served from memory */
+	unsigned long misses;    /* not cached (yet), or too large */
+	unsigned long stale;     /* dropped because the file changed */
+	unsigned long evictions; /* dropped to stay within the size bound */
+	unsigned long compressed; /* coded variants made */
+	size_t        bytes;     /* memory held by cached entries */
+	unsigned long entries;
+};
+
+/*
+ * Enable the cache, holding at most max_bytes of content.  Until this
+ * is called (or with max_bytes == 0) every lookup misses.  Return -1
+ * on error.
+ */
+int content_cache_init(size_t max_bytes);
+
+/*
+ * Start the thread making the compressed variants, in the process
+ * that serves the requests: a prefork worker calls it after the fork,
+ * as threads don't survive one.  Return -1 on error.
+ */
+int content_cache_start(void);
+
+/*
+ * Point the response of r at the cached copy of r->path (file bytes
+ * and a prebuilt response head), reading the file into the cache on a
+ * miss.  Return 0 if r now holds a reference to a cached entry, which
+ * shttp_free_req releases, or -1 if the caller has to send the file
+ * itself (content_open).
+ */
+int content_cache_respond(struct http_req *r);
+
+/*
+ * The same, without reading the file on a miss.  It blocks on no
+ * disk, though it may stat a cached file to see if it changed.
+ */
+int content_cache_lookup(struct http_req *r);
+
+/* 
+ * Set size to that of the file at path, as it was when it was cached.
+ * Return -1 if it isn't.  It never touches the disk.
+ */
+int content_cache_size(char *path, off_t *size);
+
+/*
+ * Point the response of r at a cached variant of r->path in one of
+ * the content codings (gzip, br) its Accept-Encoding allows.  Those
+ * are made by a background thread, from a precompressed sibling
+ * (r->path.gz, r->path.br) if there is one: a variant that isn't
+ * there yet is queued to be made, and -1 returned, so the request is
+ * answered uncompressed.  Otherwise as content_cache_respond.
+ */
+int content_cache_respond_encoded(struct http_req *r);
+
+/* Sum up the counters of all parts of the cache. */
+void content_cache_stats(struct content_cache_stats *s);
+
+#endif
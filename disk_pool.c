@@ -0,0 +1,118 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <util.h>
+#include <disk_pool.h>
+
+/* Submitted jobs, oldest first */
+static struct disk_job *queue_head, *queue_tail;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  queue_cond = PTHREAD_COND_INITIALIZER;
+static int nthreads;
+
+static void
+done_push(struct disk_done *d, struct disk_job *j)
+{
+	uint64_t one = 1;
+
+	j->next = NULL;
+	pthread_mutex_lock(&d->lock);
+	if (d->tail) d->tail->next = j;
+	else         d->head = j;
+	d->tail = j;
+	pthread_mutex_unlock(&d->lock);
+
+	/* EAGAIN means the counter is huge: the loop wakes up anyway */
+	if (write(d->efd, &one, sizeof(one)) < 0) return;
+}
+
+static void *
+disk_thread(void *arg)
+{
+	(void)arg;
+
+	while (1) {
+		struct disk_job *j;
+
+		pthread_mutex_lock(&queue_lock);
+		while (!queue_head) pthread_cond_wait(&queue_cond, &queue_lock);
+		j = queue_head;
+		queue_head = j->next;
+		if (!queue_head) queue_tail = NULL;
+		pthread_mutex_unlock(&queue_lock);
+
+		j->ret = client_get_file_response(j->r);
+		done_push(j->done, j);
+	}
+	return NULL;
+}
+
+int
+disk_pool_init(int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		pthread_t t;
+
+		if (pthread_create(&t, NULL, disk_thread, NULL)) return -1;
+		pthread_detach(t);
+		nthreads++;
+	}
+	return 0;
+}
+
+int
+disk_pool_enabled(void)
+{
+	return nthreads > 0;
+}
+
+int
+disk_done_init(struct disk_done *d)
+{
+	d->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (d->efd < 0) return -1;
+	pthread_mutex_init(&d->lock, NULL);
+	d->head = d->tail = NULL;
+
+	return 0;
+}
+
+void
+disk_submit(struct disk_job *j, struct disk_done *d)
+{
+	j->done = d;
+	j->next = NULL;
+
+	pthread_mutex_lock(&queue_lock);
+	if (queue_tail) queue_tail->next = j;
+	else            queue_head = j;
+	queue_tail = j;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+struct disk_job *
+disk_done_take(struct disk_done *d)
+{
+	struct disk_job *j;
+
+	pthread_mutex_lock(&d->lock);
+	j = d->head;
+	d->head = d->tail = NULL;
+	pthread_mutex_unlock(&d->lock);
+
+	return j;
+}
@@ -0,0 +1,67 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef DISK_POOL_H
+#define DISK_POOL_H
+
+#include <pthread.h>
+
+#include <simple_http.h>
+
+/* Threads doing the event loops' blocking file system work */
+#define DEFAULT_DISK_THREADS 4
+
+/*
+ * A request whose response has to come from the disk.  The event
+ * loops embed one in each connection, so submitting allocates
+ * nothing.
+ */
+struct disk_job {
+	struct http_req  *r;
+	void             *owner; /* the connection, for the loop */
+	int               ret;   /* of client_get_file_response */
+
+	struct disk_done *done;
+	struct disk_job  *next;
+};
+
+/*
+ * Where one event loop's finished jobs come back to.  efd (an
+ * eventfd) becomes readable when there are some, so the loop can wait
+ * for them along with its sockets.
+ */
+struct disk_done {
+	int              efd;
+	pthread_mutex_t  lock;
+	struct disk_job *head, *tail;
+};
+
+/*
+ * Start nthreads threads to run jobs.  With none, disk_pool_enabled
+ * is false, and loops do the work themselves.  Return -1 on error.
+ */
+int disk_pool_init(int nthreads);
+int disk_pool_enabled(void);
+
+/* Return -1 if the eventfd can't be created */
+int disk_done_init(struct disk_done *d);
+
+/*
+ * Have client_get_file_response(j->r) run on a disk thread, and j
+ * handed back through d.  r mustn't be touched meanwhile.
+ */
+void disk_submit(struct disk_job *j, struct disk_done *d);
+
+/*
+ * Take all jobs handed back through d, as a list in the order they
+ * finished.  Read d->efd first, so that a job finishing after that
+ * makes it readable again.
+ */
+struct disk_job *disk_done_take(struct disk_done *d);
+
+#endif
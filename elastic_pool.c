@@ -0,0 +1,227 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stats.h>		/* stats_now */
+#include <affinity.h>		/* affinity_pin_worker */
+#include <elastic_pool.h>
+
+/* Weight of the newest connection in the service time average: 1/8 */
+#define SERVICE_SHIFT 3
+
+static void *elastic_worker(void *arg);
+
+/*
+ * Called with the lock held, after fd was queued or while the queue
+ * is full: should another worker be started?  If so, reserve it, and
+ * describe why in reason.
+ */
+static int
+should_grow(elastic_pool_t *pool, char *reason, size_t len)
+{
+    int queued = ring_buffer_count(&pool->queue);
+    int available = pool->idle + pool->starting;
+    int busy = pool->nworkers - available;
+    unsigned long service, wait;
+
+    if (pool->nworkers >= pool->max || queued <= available) return 0;
+
+    /*
+     * Each connection beyond the available workers waits for a busy
+     * one to finish.  Until one has, assume the worst acceptable.
+     */
+    service = pool->service_us ? pool->service_us : ELASTIC_TARGET_WAIT;
+    wait = (queued - available) * service / (busy > 0 ? busy : 1);
+    if (wait < ELASTIC_TARGET_WAIT) return 0;
+
+    pool->nworkers++;
+    pool->starting++;
+    pool->grown++;
+    snprintf(reason, len, "%d queued, %d free, %d busy: ~%lu us wait at %lu us each",
+             queued, available, busy, wait, service);
+    return 1;
+}
+
+/* Start the worker reserved by should_grow (or init), without the lock */
+static void
+start_worker(elastic_pool_t *pool, char *reason)
+{
+    pthread_t thread;
+    int n;
+
+    if (!pthread_create(&thread, NULL, elastic_worker, pool)) {
+        pthread_detach(thread);
+        if (reason) {
+            printf("elastic pool: +1 worker (%s)\n", reason);
+            fflush(stdout);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->nworkers--;
+    pool->starting--;
+    if (reason) pool->grown--;
+    n = pool->nworkers;
+    pthread_mutex_unlock(&pool->lock);
+    printf("elastic pool: could not start a worker, staying at %d\n", n);
+    fflush(stdout);
+}
+
+static void *
+elastic_worker(void *arg)
+{
+    elastic_pool_t *pool = arg;
+    unsigned long served = 0; /* how long the last connection took */
+    int fd, i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->starting--;
+    i = pool->next_cpu++;
+    pthread_mutex_unlock(&pool->lock);
+    affinity_pin_worker(i);
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        if (served) {
+            if (pool->service_us) {
+                pool->service_us += ((long)served - (long)pool->service_us) >> SERVICE_SHIFT;
+            } else {
+                pool->service_us = served;
+            }
+        }
+
+        if (ring_buffer_is_empty(&pool->queue) == 0) {
+            struct timespec deadline;
+
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += ELASTIC_IDLE_TIMEOUT;
+
+            pool->idle++;
+            while (ring_buffer_is_empty(&pool->queue) == 0) {
+                if (pthread_cond_timedwait(&pool->work, &pool->lock, &deadline) != ETIMEDOUT) {
+                    continue;
+                }
+                if (ring_buffer_is_empty(&pool->queue) == 0 && pool->nworkers > pool->min) {
+                    int n;
+
+                    pool->idle--;
+                    n = --pool->nworkers;
+                    pool->retired++;
+                    pthread_mutex_unlock(&pool->lock);
+                    printf("elastic pool: -1 worker, %d left (idle for %d s)\n",
+                           n, ELASTIC_IDLE_TIMEOUT);
+                    fflush(stdout);
+                    return NULL;
+                }
+                /* one of the minimum: wait for as long as it takes */
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += ELASTIC_IDLE_TIMEOUT;
+            }
+            pool->idle--;
+        }
+
+        ring_buffer_pop_int(&pool->queue, &fd);
+        pthread_mutex_unlock(&pool->lock);
+        pthread_cond_signal(&pool->space);
+
+        served = stats_now();
+        pool->serve(fd);
+        served = stats_now() - served;
+        if (!served) served = 1;
+
+        pthread_mutex_lock(&pool->lock);
+    }
+}
+
+int
+elastic_pool_init(elastic_pool_t *pool, int min, int max, size_t capacity,
+                  void (*serve)(int fd))
+{
+    pthread_condattr_t attr;
+    int i;
+
+    if (min < 1 || max < min) return -1;
+
+    ring_buffer_init(&pool->queue, sizeof(int), capacity);
+    if (!pool->queue.begin) return -1;
+    if (pthread_mutex_init(&pool->lock, NULL)) return -1;
+
+    /* the idle timeout mustn't jump with the wall clock */
+    if (pthread_condattr_init(&attr) ||
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+        pthread_cond_init(&pool->work, &attr) ||
+        pthread_cond_init(&pool->space, NULL)) {
+        return -1;
+    }
+    pthread_condattr_destroy(&attr);
+
+    pool->serve = serve;
+    pool->min = min;
+    pool->max = max;
+    pool->nworkers = pool->starting = min;
+    pool->idle = 0;
+    pool->service_us = 0;
+    pool->grown = pool->retired = 0;
+    pool->next_cpu = 0;
+
+    for (i = 0; i < min; i++) start_worker(pool, NULL);
+    return pool->nworkers ? 0 : -1;
+}
+
+void
+elastic_pool_push(elastic_pool_t *pool, int fd)
+{
+    char reason[128];
+    int grow;
+
+    pthread_mutex_lock(&pool->lock);
+    while (ring_buffer_is_full(&pool->queue) == 0) {
+        if (should_grow(pool, reason, sizeof(reason))) {
+            pthread_mutex_unlock(&pool->lock);
+            start_worker(pool, reason);
+            pthread_mutex_lock(&pool->lock);
+            continue;
+        }
+        pthread_cond_wait(&pool->space, &pool->lock);
+    }
+    ring_buffer_push_int(&pool->queue, fd);
+    grow = should_grow(pool, reason, sizeof(reason));
+    pthread_mutex_unlock(&pool->lock);
+    pthread_cond_signal(&pool->work);
+
+    if (grow) start_worker(pool, reason);
+}
+
+size_t
+elastic_pool_size(elastic_pool_t *pool)
+{
+    size_t n;
+
+    pthread_mutex_lock(&pool->lock);
+    n = ring_buffer_count(&pool->queue);
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
+
+void
+elastic_pool_stats(elastic_pool_t *pool, struct elastic_pool_stats *s)
+{
+    pthread_mutex_lock(&pool->lock);
+    s->workers = pool->nworkers;
+    s->min = pool->min;
+    s->max = pool->max;
+    s->service_us = pool->service_us;
+    s->grown = pool->grown;
+    s->retired = pool->retired;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,80 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef ELASTIC_POOL_H
+#define ELASTIC_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include <ring_buffer.h>
+
+/* Default bounds on the number of workers (-w min:max) */
+#define ELASTIC_MIN_WORKERS 2
+#define ELASTIC_MAX_WORKERS 64
+/* Seconds a worker above the minimum waits for work before exiting */
+#define ELASTIC_IDLE_TIMEOUT 5
+/*
+ * How long (us) a connection may be expected to wait in the queue
+ * before another worker is started for it.
+ */
+#define ELASTIC_TARGET_WAIT 1000
+
+/*
+ * A thread pool sharing a ring_buffer of fds, like the bounded one,
+ * but whose size follows the load.  The acceptor starts a worker when
+ * the connections queued beyond the idle workers would, at the
+ * service time observed so far, wait longer than ELASTIC_TARGET_WAIT
+ * for a busy one to free up.  A worker that has had nothing to do for
+ * ELASTIC_IDLE_TIMEOUT seconds exits, down to min workers.  Each
+ * change is printed along with its reason.
+ */
+typedef struct elastic_pool_t {
+    ring_buffer_t queue;
+    pthread_mutex_t lock;
+    pthread_cond_t work;  /* a connection was queued */
+    pthread_cond_t space; /* the queue has room again */
+    void (*serve)(int fd);
+
+    int min, max;
+    int nworkers; /* live ones, starting ones included */
+    int idle;     /* waiting for work */
+    int starting; /* created, but not waiting or serving yet */
+    unsigned long service_us; /* moving average, 0 before the first */
+
+    unsigned long grown, retired;
+    int next_cpu; /* which of the affinity list the next worker gets */
+} elastic_pool_t;
+
+struct elastic_pool_stats {
+    int workers, min, max;
+    unsigned long service_us; /* average time to serve a connection */
+    unsigned long grown;      /* workers started past the minimum */
+    unsigned long retired;    /* idle workers that exited */
+};
+
+/*
+ * Initialize the pool with a queue of room for capacity fds, and start
+ * min workers, which call serve on each fd they take.  Return 0 on
+ * success, -1 otherwise.
+ */
+int elastic_pool_init(elastic_pool_t *pool, int min, int max, size_t capacity,
+                      void (*serve)(int fd));
+
+/*
+ * Acceptor only: queue fd, starting a worker for it if need be, and
+ * waiting while the queue is full.
+ */
+void elastic_pool_push(elastic_pool_t *pool, int fd);
+
+/* Number of fds queued.  Only a snapshot, for the stats. */
+size_t elastic_pool_size(elastic_pool_t *pool);
+
+void elastic_pool_stats(elastic_pool_t *pool, struct elastic_pool_stats *s);
+
+#endif
@@ -0,0 +1,455 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <server.h>
+#include <simple_http.h>
+#include <util.h>
+#include <pool.h>
+#include <stats.h>
+#include <disk_pool.h>
+#include <event.h>
+
+#define MAX_EVENTS 256
+
+/*
+ * Per-connection state.  A connection is READING until a whole
+ * request head has arrived, and then WRITING until the response has
+ * been flushed.  A persistent connection then goes back to READING,
+ * starting with any pipelined requests already buffered.  A request
+ * that can't be answered from memory is handed to the disk pool, and
+ * its connection is at DISK until the response comes back.
+ */
+typedef enum {
+	CONN_READING,
+	CONN_DISK,
+	CONN_WRITING,
+} conn_state_t;
+
+struct conn {
+	conn_state_t     state;
+	/* what we are registered for; 0 if not in the epoll set */
+	unsigned int     events;
+	struct disk_job  job;
+
+	/* READING: the bytes received so far (and the fd) */
+	struct http_conn in;
+
+	/* WRITING: the request/response, and how much of it went out */
+	struct http_req *r;
+	off_t            sent;
+	unsigned long    start; /* when the request arrived */
+
+	/* 
+	 * While waiting on the client, the connection sits on one of the
+	 * loop's timer lists, oldest first, and is closed once its
+	 * deadline passes: the idle list between requests, and the io
+	 * list while a request head is coming in, or a write is stuck.
+	 */
+	time_t           deadline;
+	struct conn     *timer; /* the list it is on */
+	struct conn     *timer_next, *timer_prev;
+};
+
+struct event_loop {
+	int              epfd, accept_fd;
+	struct conn      idle; /* head of the idle list (keepalive_timeout) */
+	struct conn      io;   /* head of the io list (io_timeout) */
+	struct disk_done done; /* responses back from the disk pool */
+};
+
+/*
+ * epoll_event.data.ptr is the connection, or one of these markers for
+ * the listen socket and the disk pool's eventfd.
+ */
+static char listen_marker, disk_marker;
+
+static time_t
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void
+timer_remove(struct conn *c)
+{
+	if (!c->timer) return;
+	c->timer_prev->timer_next = c->timer_next;
+	c->timer_next->timer_prev = c->timer_prev;
+	c->timer_next = c->timer_prev = c->timer = NULL;
+}
+
+/* 
+ * (Re)start the connection's timer for secs, at the end of list: all
+ * on a list have the same timeout, so it stays in deadline order.
+ */
+static void
+timer_touch(struct conn *list, struct conn *c, int secs)
+{
+	timer_remove(c);
+	if (!secs) return;
+
+	c->deadline   = now_sec() + secs;
+	c->timer      = list;
+	c->timer_next = list;
+	c->timer_prev = list->timer_prev;
+	list->timer_prev->timer_next = c;
+	list->timer_prev = c;
+}
+
+/* 
+ * Waiting for the client's next request.  Idle between requests, it
+ * gets keepalive_timeout.  Once a head has started (or for the first
+ * one), it has io_timeout for all of it, so it can't be kept going
+ * by a byte at a time.
+ */
+static void
+timer_reading(struct event_loop *l, struct conn *c)
+{
+	if (!c->in.len && c->in.served) timer_touch(&l->idle, c, keepalive_timeout);
+	else if (c->timer != &l->io)    timer_touch(&l->io, c, io_timeout);
+}
+
+static struct pool_type conn_pool = POOL_TYPE("conn", sizeof(struct conn));
+
+static struct conn *
+conn_alloc(int fd)
+{
+	struct conn *c;
+
+	c = pool_alloc(&conn_pool);
+	if (!c) return NULL;
+	memset(c, 0, sizeof(struct conn));
+
+	c->in.fd  = fd;
+	c->state  = CONN_READING;
+	c->events = EPOLLIN;
+
+	return c;
+}
+
+void
+event_conn_stats(struct pool_stats *s)
+{
+	pool_stats(&conn_pool, s);
+}
+
+/*
+ * Closing the fd also removes it from the epoll set.
+ */
+static void
+conn_free(struct conn *c)
+{
+	timer_remove(c);
+	if (c->r) shttp_free_req(c->r);
+	close(c->in.fd);
+	server_release();
+	pool_free(&conn_pool, c);
+}
+
+/*
+ * Pull whatever is available off the socket, unless a (pipelined)
+ * request is buffered already.  Return the length of the request
+ * head once it is complete (or the buffer is full, and the parser
+ * has to make do), 0 if we need to wait for more, and -1 if the
+ * connection is dead.
+ */
+static int
+conn_read(struct conn *c)
+{
+	struct http_conn *in = &c->in;
+	int len;
+
+	while (!(len = conn_req_len(in))) {
+		int ret;
+
+		if (in->len == MAX_REQ_SZ) return in->len;
+
+		ret = read(in->fd, in->buf + in->len, MAX_REQ_SZ - in->len);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		/* peer is done sending: parse what we have, if anything */
+		if (ret == 0) return in->len > 0 ? in->len : -1;
+		in->len += ret;
+	}
+	return len;
+}
+
+static int
+conn_want(struct event_loop *l, struct conn *c, unsigned int events)
+{
+	struct epoll_event ev;
+	int op = c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	if (c->events == events) return 0;
+	c->events   = events;
+	ev.events   = events;
+	ev.data.ptr = c;
+	return epoll_ctl(l->epfd, op, c->in.fd, &ev);
+}
+
+/*
+ * The request head of len bytes is in: parse it, fetch the content
+ * and formulate the response.  Return 0 once it is ready to be
+ * written, 1 if it went to the disk pool, and -1 if the connection
+ * should be dropped.
+ */
+static int
+conn_respond(struct event_loop *l, struct conn *c, int len)
+{
+	int ret;
+
+	c->start = stats_now();
+	c->r = conn_create_req(&c->in, len);
+	if (!c->r) return -1;
+
+	ret = client_get_cached_response(c->r);
+	if (ret > 0 && disk_pool_enabled()) {
+		/* 
+		 * Out of the epoll set meanwhile, so that a hangup can't
+		 * free the connection under the disk thread.
+		 */
+		if (epoll_ctl(l->epfd, EPOLL_CTL_DEL, c->in.fd, NULL)) return -1;
+		c->events    = 0;
+		c->state     = CONN_DISK;
+		c->job.r     = c->r;
+		c->job.owner = c;
+		disk_submit(&c->job, &l->done);
+		return 1;
+	}
+	if (ret > 0) ret = client_get_file_response(c->r);
+	if (ret) return -1;
+
+	c->state = CONN_WRITING;
+	c->sent  = 0;
+
+	return 0;
+}
+
+/*
+ * Drive the connection's state machine as far as it will go on this
+ * event: possibly through several pipelined requests.  The
+ * connection is freed once it is done or dead.
+ */
+static void
+conn_event(struct event_loop *l, struct conn *c, unsigned int events)
+{
+	int ret, keep_alive;
+
+	if (events & (EPOLLERR | EPOLLHUP)) goto done;
+
+	while (1) {
+		if (c->state == CONN_READING) {
+			ret = conn_read(c);
+			if (ret < 0) goto done;
+			if (ret == 0) {
+				timer_reading(l, c);
+				if (conn_want(l, c, EPOLLIN)) goto done;
+				return;
+			}
+			timer_remove(c);
+			ret = conn_respond(l, c, ret);
+			if (ret < 0) goto done;
+			if (ret > 0) return;
+		}
+
+		ret = client_write_response(c->r, &c->sent);
+		if (ret < 0) {
+			stats_add(STAT_ERRORS, 1);
+			goto done;
+		}
+		if (ret == 0) {
+			/* the socket is full, resume once it drains, if soon */
+			timer_touch(&l->io, c, io_timeout);
+			if (conn_want(l, c, EPOLLOUT)) goto done;
+			return;
+		}
+		timer_remove(c);
+		stats_request_done(c->r, c->start);
+
+		keep_alive = c->r->keep_alive;
+		shttp_free_req(c->r);
+		c->r = NULL;
+		if (!keep_alive) goto done;
+		c->state = CONN_READING;
+	}
+done:
+	conn_free(c);
+}
+
+/*
+ * Carry on with the connections whose responses the disk pool has
+ * finished.
+ */
+static void
+disk_complete(struct event_loop *l)
+{
+	struct disk_job *j, *next;
+	uint64_t cnt;
+
+	if (read(l->done.efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+		perror("read eventfd");
+	}
+	for (j = disk_done_take(&l->done); j; j = next) {
+		struct conn *c = j->owner;
+
+		next = j->next;
+		if (j->ret) {
+			conn_free(c);
+			continue;
+		}
+		c->state = CONN_WRITING;
+		c->sent  = 0;
+		conn_event(l, c, 0);
+	}
+}
+
+/*
+ * Close the connections on list whose time is up.  The list is in
+ * deadline order, so we can stop at the first that isn't.
+ */
+static void
+timer_expire(struct conn *list, time_t now)
+{
+	while (list->timer_next != list && list->timer_next->deadline <= now) {
+		conn_free(list->timer_next);
+	}
+}
+
+/*
+ * Accept every pending connection, and register each to be woken
+ * up when its request arrives.
+ */
+static void
+accept_all(struct event_loop *l)
+{
+	while (1) {
+		struct epoll_event ev;
+		struct conn *c;
+		int fd;
+
+		fd = accept4(l->accept_fd, NULL, NULL, SOCK_NONBLOCK);
+		if (fd < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+			return;
+		}
+
+		stats_add(STAT_CONNS, 1);
+		if (server_admit(fd)) continue;
+		server_set_nodelay(fd);
+		c = conn_alloc(fd);
+		if (!c) {
+			close(fd);
+			server_release();
+			continue;
+		}
+		ev.events   = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			perror("epoll_ctl");
+			conn_free(c);
+			continue;
+		}
+		timer_reading(l, c);
+	}
+}
+
+static void
+loop_run(int accept_fd, int exclusive)
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct event_loop l;
+
+	server_raise_fd_limit();
+	if (server_set_nonblock(accept_fd)) return;
+
+	l.accept_fd = accept_fd;
+	l.idle.timer_next = l.idle.timer_prev = &l.idle;
+	l.io.timer_next   = l.io.timer_prev   = &l.io;
+	l.epfd = epoll_create1(0);
+	if (l.epfd < 0) {
+		perror("epoll_create1");
+		return;
+	}
+	ev.events   = EPOLLIN | (exclusive ? EPOLLEXCLUSIVE : 0);
+	ev.data.ptr = &listen_marker;
+	if (epoll_ctl(l.epfd, EPOLL_CTL_ADD, accept_fd, &ev)) {
+		perror("epoll_ctl");
+		close(l.epfd);
+		return;
+	}
+	if (disk_done_init(&l.done)) {
+		perror("eventfd");
+		close(l.epfd);
+		return;
+	}
+	ev.events   = EPOLLIN;
+	ev.data.ptr = &disk_marker;
+	if (epoll_ctl(l.epfd, EPOLL_CTL_ADD, l.done.efd, &ev)) {
+		perror("epoll_ctl");
+		close(l.done.efd);
+		close(l.epfd);
+		return;
+	}
+
+	while (1) {
+		int i, n;
+
+		/* wake up once a second to close idle and stuck connections */
+		n = epoll_wait(l.epfd, events, MAX_EVENTS, 
+			       keepalive_timeout || io_timeout ? 1000 : -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &listen_marker) {
+				accept_all(&l);
+			} else if (events[i].data.ptr == &disk_marker) {
+				disk_complete(&l);
+			} else {
+				conn_event(&l, events[i].data.ptr, events[i].events);
+			}
+		}
+		timer_expire(&l.idle, now_sec());
+		timer_expire(&l.io, now_sec());
+	}
+	close(l.done.efd);
+	close(l.epfd);
+}
+
+void
+event_loop(int accept_fd)
+{
+	loop_run(accept_fd, 0);
+}
+
+void
+event_loop_exclusive(int accept_fd)
+{
+	loop_run(accept_fd, 1);
+}
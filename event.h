@@ -0,0 +1,30 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+/*
+ * Serve every connection accepted on accept_fd from a single thread,
+ * driving the listen socket and all client sockets through epoll.
+ * Only returns on a fatal error.
+ */
+void event_loop(int accept_fd);
+
+/*
+ * Like event_loop, for when other processes wait on accept_fd too:
+ * a new connection wakes only one of them (EPOLLEXCLUSIVE), rather
+ * than the whole herd.
+ */
+void event_loop_exclusive(int accept_fd);
+
+struct pool_stats;
+/* Allocation counters of the event loops' connection pools */
+void event_conn_stats(struct pool_stats *s);
+
+#endif
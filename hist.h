@@ -0,0 +1,60 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef HIST_H
+#define HIST_H
+
+/*
+ * Log-linear (HDR-style) histograms of latencies: values below
+ * HIST_SUB are counted exactly, and every power of two above is split
+ * into HIST_SUB buckets, so a percentile read back is within about
+ * 3% of the real one.  A histogram is an array of HIST_BUCKETS
+ * counters, and merging two is adding them up.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+static inline int
+hist_index(unsigned long v)
+{
+	int msb;
+
+	if (v < HIST_SUB) return v;
+	msb = 63 - __builtin_clzl(v);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+	       ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* The smallest value that lands in bucket i */
+static inline unsigned long
+hist_value(int i)
+{
+	int shift = i / HIST_SUB - 1;
+
+	if (i < HIST_SUB) return i;
+	return (unsigned long)(HIST_SUB + i % HIST_SUB) << shift;
+}
+
+/* Value at or below which fraction p of the n samples lie */
+static inline unsigned long
+hist_percentile(unsigned long *hist, unsigned long n, double p)
+{
+	unsigned long seen = 0, want = (unsigned long)(p * n);
+	int i;
+
+	if (!n) return 0;
+	if (want >= n) want = n - 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen > want) return hist_value(i);
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,203 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHTTP_X86
+#endif
+
+#include <http_parse.h>
+
+static char *
+find_byte_scalar(char *s, char *end, char c)
+{
+	for (; s < end; s++) {
+		if (*s == c) return s;
+	}
+	return NULL;
+}
+
+#ifdef SHTTP_X86
+/*
+ * Compare 16 bytes at once against c, and take the lowest match from
+ * the mask of the lanes that matched.
+ */
+__attribute__((target("sse2")))
+static char *
+find_byte_sse2(char *s, char *end, char c)
+{
+	__m128i n = _mm_set1_epi8(c);
+
+	for (; end - s >= 16; s += 16) {
+		__m128i v = _mm_loadu_si128((__m128i *)s);
+		int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, n));
+
+		if (m) return s + __builtin_ctz(m);
+	}
+	return find_byte_scalar(s, end, c);
+}
+
+/* The same, 32 bytes at a time */
+__attribute__((target("avx2")))
+static char *
+find_byte_avx2(char *s, char *end, char c)
+{
+	__m256i n = _mm256_set1_epi8(c);
+
+	for (; end - s >= 32; s += 32) {
+		__m256i v = _mm256_loadu_si256((__m256i *)s);
+		unsigned int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, n));
+
+		if (m) return s + __builtin_ctz(m);
+	}
+	return find_byte_sse2(s, end, c);
+}
+#endif
+
+static char *find_byte_select(char *s, char *end, char c);
+
+/* Chosen on the first call, by what the processor supports */
+static char *(*find_byte)(char *s, char *end, char c) = find_byte_select;
+
+static char *
+find_byte_select(char *s, char *end, char c)
+{
+#ifdef SHTTP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))      find_byte = find_byte_avx2;
+	else if (__builtin_cpu_supports("sse2")) find_byte = find_byte_sse2;
+	else                                     find_byte = find_byte_scalar;
+#else
+	find_byte = find_byte_scalar;
+#endif
+	return find_byte(s, end, c);
+}
+
+char *
+shttp_find_byte(char *s, char *end, char c)
+{
+	return find_byte(s, end, c);
+}
+
+/*
+ * The head ends with an empty line: a '\n' right after the '\n' (or
+ * "\n\r") ending the line before.  So we only ever look for newlines,
+ * and check the byte or two before each.  Those are always in the
+ * buffer, which is why we can pick up where we left off.
+ */
+int
+shttp_parse_len(struct shttp_parser *p, char *buf, int len)
+{
+	char *s = buf + p->scanned, *end = buf + len;
+
+	if (p->head_len) return p->head_len;
+
+	while ((s = find_byte(s, end, '\n'))) {
+		int i = s - buf;
+
+		if ((i >= 1 && buf[i - 1] == '\n') ||
+		    (i >= 2 && buf[i - 1] == '\r' && buf[i - 2] == '\n')) {
+			p->head_len = i + 1;
+			return p->head_len;
+		}
+		s++;
+	}
+	p->scanned = len;
+
+	return 0;
+}
+
+/* Drop the spaces (and a trailing '\r') around v */
+static void
+str_trim(struct shttp_str *v)
+{
+	while (v->len && (*v->p == ' ' || *v->p == '\t')) {
+		v->p++;
+		v->len--;
+	}
+	while (v->len && (v->p[v->len - 1] == ' ' || v->p[v->len - 1] == '\t' ||
+			  v->p[v->len - 1] == '\r')) {
+		v->len--;
+	}
+}
+
+#define HEADER(name, field) { name, sizeof(name) - 1, offsetof(struct shttp_head, field) }
+
+static const struct {
+	const char *name;
+	int         len;
+	size_t      off;
+} headers[] = {
+	HEADER("Host",              host),
+	HEADER("Connection",        connection),
+	HEADER("If-None-Match",     if_none_match),
+	HEADER("If-Modified-Since", if_modified_since),
+	HEADER("Range",             range),
+	HEADER("If-Range",          if_range),
+	HEADER("Accept-Encoding",   accept_encoding),
+};
+
+int
+shttp_parse_head(char *buf, int len, struct shttp_head *h)
+{
+	char *end = buf + len, *line, *eol, *sp;
+	unsigned int i;
+
+	memset(h, 0, sizeof(struct shttp_head));
+
+	/* request line: <method> <path> HTTP/1.<minor> */
+	eol = find_byte(buf, end, '\n');
+	if (!eol) eol = end;
+
+	sp = find_byte(buf, eol, ' ');
+	if (!sp || sp == buf) return -1;
+	h->method.p   = buf;
+	h->method.len = sp - buf;
+
+	h->path.p = sp + 1;
+	sp = find_byte(h->path.p, eol, ' ');
+	if (!sp || sp == h->path.p) return -1;
+	h->path.len = sp - h->path.p;
+
+	sp++;
+	if (eol - sp >= 8 && !memcmp(sp, "HTTP/1.", 7) && sp[7] >= '0' && sp[7] <= '9') {
+		h->minor = sp[7] - '0';
+	}
+
+	/* headers: <name>: <value>, until the empty line */
+	for (line = eol + 1; line < end; line = eol + 1) {
+		struct shttp_str name, value;
+		char *colon;
+
+		eol = find_byte(line, end, '\n');
+		if (!eol) eol = end;
+		if (eol == line || (eol == line + 1 && *line == '\r')) break;
+
+		colon = find_byte(line, eol, ':');
+		if (!colon) continue;
+		name.p    = line;
+		name.len  = colon - line;
+		value.p   = colon + 1;
+		value.len = eol - value.p;
+
+		for (i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+			if (name.len == headers[i].len &&
+			    !strncasecmp(name.p, headers[i].name, name.len)) {
+				str_trim(&value);
+				*(struct shttp_str *)((char *)h + headers[i].off) = value;
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,63 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef HTTP_PARSE_H
+#define HTTP_PARSE_H
+
+/*
+ * A view of len bytes into the request buffer: not copied, and not
+ * NUL-terminated.  p is NULL if the thing viewed isn't there.
+ */
+struct shttp_str {
+	char *p;
+	int   len;
+};
+
+/*
+ * Where the search for the end of a request head left off.  More of
+ * the head can be appended to the buffer between calls, and only the
+ * new bytes are looked at.  Start (and restart, once the head is
+ * taken off the buffer) with all zeros.
+ */
+struct shttp_parser {
+	int scanned;  /* bytes known not to end the head */
+	int head_len; /* once found, the length of the head */
+};
+
+/* The parts of a request head we care about */
+struct shttp_head {
+	struct shttp_str method, path;
+	int              minor; /* HTTP/1.<minor> */
+
+	struct shttp_str host, connection, if_none_match, if_modified_since;
+	struct shttp_str range, if_range, accept_encoding;
+};
+
+/*
+ * Look for the blank line ending the request head in the len bytes of
+ * buf, starting where the last call on the same buffer stopped.
+ * Return the length of the head, up to and including its blank line,
+ * or 0 if more has yet to arrive.
+ */
+int shttp_parse_len(struct shttp_parser *p, char *buf, int len);
+
+/*
+ * Parse the request line and the headers of the head in the len bytes
+ * of buf (which may be cut short of its blank line) into views into
+ * buf.  Headers that aren't there are left NULL.  Return -1 if there
+ * is no well-formed request line.
+ */
+int shttp_parse_head(char *buf, int len, struct shttp_head *h);
+
+/*
+ * The first c in [s, end), or NULL: with AVX2 or SSE2 compares 32 or
+ * 16 bytes at a time, if the processor has them.
+ */
+char *shttp_find_byte(char *s, char *end, char c);
+
+#endif
@@ -0,0 +1,365 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+/*
+ * A load generator for the server, so it can be measured without
+ * httperf.  Each client thread keeps one request outstanding at a
+ * time, either
+ *
+ * - closed-loop (the default): sending the next request as soon as
+ *   the last one is answered, to find the maximum throughput, or
+ * - open-loop (-r): sending requests at a fixed rate whether or not
+ *   the server keeps up.  Latency is then measured from when each
+ *   request was due rather than from when it was sent, so a server
+ *   that falls behind isn't flattered by the clients waiting on it.
+ *
+ * Connections are either kept alive across requests (-k, HTTP/1.1),
+ * or opened for every request (HTTP/1.0).  The requested paths are
+ * drawn from a weighted mix (-m), a file with one "<weight> <path>"
+ * per line.
+ *
+ * Example usage:
+ * # ./loadgen -p 8080 -t 8 -k -d 10
+ * # ./loadgen -p 8080 -r 5000 -m bench.mix
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <hist.h>
+
+#define MAX_THREADS   256
+#define MAX_PATHS     64
+#define MAX_PATH_SZ   256
+#define RESP_BUF_SZ   (64 * 1024)
+/* a reply taking longer than this counts as an error */
+#define REPLY_TIMEOUT 2
+
+struct path {
+	char     path[MAX_PATH_SZ];
+	unsigned weight;
+};
+
+struct client {
+	pthread_t      thread;
+	int            id;
+	unsigned long  seed;
+
+	/* results */
+	unsigned long  reqs, errors, shed;
+	unsigned long  latency; /* us, summed over the requests */
+	unsigned long  hist[HIST_BUCKETS];
+} __attribute__((aligned(64)));
+
+static struct sockaddr_in server;
+static int           nthreads = 4, duration = 5, keep_alive, rate;
+static struct path   paths[MAX_PATHS];
+static int           npaths;
+static unsigned      total_weight;
+static volatile int  stop;
+static char          resp_buf[MAX_THREADS][RESP_BUF_SZ];
+
+static unsigned long
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static unsigned long
+xorshift(unsigned long *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static struct path *
+pick_path(struct client *c)
+{
+	unsigned w = xorshift(&c->seed) % total_weight;
+	int i;
+
+	for (i = 0; i < npaths - 1; i++) {
+		if (w < paths[i].weight) break;
+		w -= paths[i].weight;
+	}
+	return &paths[i];
+}
+
+static int
+add_path(unsigned weight, const char *path)
+{
+	if (npaths == MAX_PATHS || !weight) return -1;
+	if (strlen(path) >= MAX_PATH_SZ) return -1;
+	strcpy(paths[npaths].path, path);
+	paths[npaths].weight = weight;
+	npaths++;
+	total_weight += weight;
+
+	return 0;
+}
+
+/* Lines of "<weight> <path>"; empty lines and #comments are skipped */
+static int
+read_mix(const char *file)
+{
+	char line[MAX_PATH_SZ + 32], path[MAX_PATH_SZ];
+	unsigned weight;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f) {
+		perror(file);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n') continue;
+		if (sscanf(line, "%u %255s", &weight, path) != 2 ||
+		    add_path(weight, path)) {
+			printf("%s: bad line: %s", file, line);
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+
+	return npaths ? 0 : -1;
+}
+
+static int
+client_connect(void)
+{
+	struct timeval tv = { .tv_sec = REPLY_TIMEOUT };
+	int fd, one = 1;
+
+	fd = socket(PF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, (struct sockaddr *)&server, sizeof(server))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Send the request for path and read the whole response.  Return 0
+ * if the connection can be used for the next request, 1 if the
+ * server closed it, and -1 on error.  *shed is set if the server
+ * turned the request away (503).
+ */
+static int
+client_request(int fd, struct path *p, char *buf, int *shed)
+{
+	char *head_end = NULL, *cl;
+	int len, got = 0, closes;
+	long body = -1;
+
+	len = snprintf(buf, RESP_BUF_SZ, "GET %s HTTP/1.%d\r\nHost: localhost\r\n\r\n",
+		       p->path, keep_alive);
+	if (write(fd, buf, len) != len) return -1;
+
+	/* the head */
+	while (!head_end) {
+		int ret = read(fd, buf + got, RESP_BUF_SZ - 1 - got);
+
+		if (ret <= 0) return -1;
+		got += ret;
+		buf[got] = '\0';
+		head_end = strstr(buf, "\r\n\r\n");
+		if (!head_end && got == RESP_BUF_SZ - 1) return -1;
+	}
+	if (strncmp(buf, "HTTP/1.", 7)) return -1;
+	*head_end = '\0';
+	*shed = !strncmp(buf + 8, " 503", 4);
+	closes = !keep_alive || strstr(buf, "Connection: close") != NULL;
+	cl = strstr(buf, "Content-Length:");
+	if (cl) body = atol(cl + strlen("Content-Length:"));
+
+	/* the body: up to its length, or until the server closes */
+	got -= head_end + 4 - buf;
+	while (body < 0 || got < body) {
+		int ret = read(fd, buf, RESP_BUF_SZ);
+
+		if (ret == 0 && body < 0) break;
+		if (ret <= 0) return -1;
+		got += ret;
+	}
+	if (body >= 0 && got != body) return -1;
+
+	return closes;
+}
+
+static void *
+client_thread(void *arg)
+{
+	struct client *c = arg;
+	char *buf = resp_buf[c->id];
+	unsigned long start = now_us(), due = start, interval = 0;
+	int fd = -1;
+
+	if (rate) {
+		interval = 1000000UL * nthreads / rate;
+		/* spread the clients' schedules over the interval */
+		due += interval * c->id / nthreads;
+	}
+
+	while (!stop) {
+		unsigned long begin, end;
+		int ret, shed = 0;
+
+		if (rate) {
+			unsigned long now = now_us();
+
+			if (now < due) usleep(due - now);
+			begin = due;
+			due  += interval;
+		} else {
+			begin = now_us();
+		}
+
+		if (fd < 0 && (fd = client_connect()) < 0) {
+			c->errors++;
+			/* don't spin on a server that is down */
+			usleep(1000);
+			continue;
+		}
+		ret = client_request(fd, pick_path(c), buf, &shed);
+		end = now_us();
+		if (ret != 0) {
+			close(fd);
+			fd = -1;
+		}
+		if (ret < 0) {
+			c->errors++;
+			continue;
+		}
+		/* only the requests served count towards req/s and latency */
+		if (shed) {
+			c->shed++;
+			continue;
+		}
+		c->reqs++;
+		c->latency += end - begin;
+		c->hist[hist_index(end - begin)]++;
+	}
+	if (fd >= 0) close(fd);
+
+	return NULL;
+}
+
+static void
+print_header(void)
+{
+	printf("%-12s %10s %10s %10s %10s %10s %8s %8s\n",
+	       "", "req/s", "mean (us)", "p50 (us)", "p99 (us)", "p999 (us)", "errors", "503s");
+}
+
+static void
+usage(char *prog)
+{
+	printf("Usage: %s [options]\n"
+	       "-p <port>: port of the server on localhost (default 8080)\n"
+	       "-t <n>: client threads, each with a request outstanding "
+	       "(default 4, at most %d)\n"
+	       "-d <s>: seconds to run for (default 5)\n"
+	       "-r <n>: send n requests per second in all (open-loop); "
+	       "by default each client sends as fast as it can (closed-loop)\n"
+	       "-k: keep connections alive (HTTP/1.1), rather than a new "
+	       "connection per request (HTTP/1.0)\n"
+	       "-m <file>: paths to request, a \"<weight> <path>\" per "
+	       "line (default /README.md)\n"
+	       "-l <label>: name of the result row\n"
+	       "-H: only print the header of the result table\n",
+	       prog, MAX_THREADS);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static struct client clients[MAX_THREADS];
+	static unsigned long hist[HIST_BUCKETS];
+	unsigned long reqs = 0, errors = 0, shed = 0, latency = 0, start, elapsed;
+	const char *label = "";
+	int port = 8080, opt, i, j;
+
+	while ((opt = getopt(argc, argv, "p:t:d:r:km:l:H")) != -1) {
+		switch (opt) {
+		case 'p': port = atoi(optarg); break;
+		case 't': nthreads = atoi(optarg); break;
+		case 'd': duration = atoi(optarg); break;
+		case 'r': rate = atoi(optarg); break;
+		case 'k': keep_alive = 1; break;
+		case 'm':
+			if (read_mix(optarg)) return -1;
+			break;
+		case 'l': label = optarg; break;
+		case 'H':
+			print_header();
+			return 0;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (nthreads < 1 || nthreads > MAX_THREADS || duration < 1 || rate < 0) {
+		usage(argv[0]);
+		return -1;
+	}
+	if (!npaths) add_path(1, "/README.md");
+
+	server.sin_family      = AF_INET;
+	server.sin_port        = htons(port);
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	start = now_us();
+	for (i = 0; i < nthreads; i++) {
+		clients[i].id   = i;
+		clients[i].seed = 88172645463325252UL + i;
+		if (pthread_create(&clients[i].thread, NULL, client_thread, &clients[i])) {
+			perror("pthread_create");
+			return -1;
+		}
+	}
+	sleep(duration);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(clients[i].thread, NULL);
+		reqs   += clients[i].reqs;
+		errors += clients[i].errors;
+		shed   += clients[i].shed;
+		latency += clients[i].latency;
+		for (j = 0; j < HIST_BUCKETS; j++) hist[j] += clients[i].hist[j];
+	}
+	elapsed = now_us() - start;
+
+	printf("%-12s %10.0f %10lu %10lu %10lu %10lu %8lu %8lu\n", label,
+	       reqs * 1e6 / elapsed,
+	       reqs ? latency / reqs : 0,
+	       hist_percentile(hist, reqs, 0.50),
+	       hist_percentile(hist, reqs, 0.99),
+	       hist_percentile(hist, reqs, 0.999),
+	       errors, shed);
+
+	return 0;
+}
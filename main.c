@@ -29,18 +29,39 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
+#include <signal.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
 #include <pthread.h>
 
 #include <util.h> 		/* client_process */
 #include <server.h>		/* server_accept and server_create */
+#include <event.h>		/* event_loop */
+#include <uring.h>		/* uring_loop */
+#include <content_cache.h>	/* content_cache_init */
+#include <pack.h>		/* pack_load */
+#include <disk_pool.h>		/* disk_pool_init */
+#include <affinity.h>		/* affinity_pin */
+#include <simple_http.h>	/* shttp_req_stats */
+#include <pool.h>
+#include <stats.h>		/* stats_set_queue_depth */
 
 #include <cas.h>
 
 #include <ring_buffer.h>
+#include <mpmc_ring.h>
+#include <ws_pool.h>
+#include <elastic_pool.h>
+#include <sjf_queue.h>
 
 #define MAX_DATA_SZ 1024
 #define MAX_CONCURRENCY 4
+/* Most fds the acceptor queues per lock */
+#define POOL_BATCH 8
+#define DEFAULT_CACHE_MB 64
 
 /*
  * Define a mutex.
@@ -48,13 +69,23 @@
 pthread_mutex_t mutex;
 
 /*
- * Define thread conditions
+ * Define the thread condition: workers wait on it for connections
  */
 pthread_cond_t master_cond;
-pthread_cond_t worker_cond;
 
 ring_buffer_t ring_buffer; /* define ring buffer */
 
+/* The bounded pool's queue instead, by response size, with -s */
+sjf_queue_t sjf_queue;
+int sjf_age; /* ms per size class, 0: serve in order */
+
+mpmc_ring_t mpmc_ring; /* lock-free ring for the lock-free thread pool */
+
+ws_pool_t ws_pool; /* a deque per worker for the work-stealing pool */
+
+elastic_pool_t elastic_pool; /* ring buffer and workers of the elastic pool */
+int elastic_min = ELASTIC_MIN_WORKERS, elastic_max = ELASTIC_MAX_WORKERS;
+
 
 
 /*
@@ -75,7 +106,9 @@ server_single_request(int accept_fd)
      * That main thread will want to hand off the new fd to the
      * new threads/processes/thread pool.
      */
-    fd = server_accept(accept_fd);
+    do {
+        fd = server_accept(accept_fd);
+    } while (fd < 0); /* shed (-m), or the accept failed */
     client_process(fd);
 
     /*
@@ -114,7 +147,13 @@ server_thread_per_req(int accept_fd)
     while(1) {
         /* create threads until max concurrency */
         for(i = 0; i < MAX_CONCURRENCY; i++) {
-            fd = server_accept(accept_fd);
+            /* idle persistent connections come back here, rather than hold their threads */
+            fd = client_next(accept_fd, 1);
+            /* shed (-m), or the accept failed: no thread for it */
+            if (fd < 0) {
+                i--;
+                continue;
+            }
             pthread_create(&thread[i], NULL, &worker_per_request, (void *) fd);
         }
 
@@ -127,32 +166,79 @@ server_thread_per_req(int accept_fd)
     return;
 }
 
+/*
+ * Is the bounded pool's queue empty?  (Call with mutex held.)
+ */
+int bounded_pool_is_empty(void)
+{
+    if (sjf_age) return sjf_queue_count(&sjf_queue) == 0;
+    return ring_buffer_is_empty(&ring_buffer) == 0;
+}
+
 /*
  * Creates a pthread worker, locked on a condition variable that checks
  *  the file descriptor ring buffer. Will wait if ring buffer is empty.
  */
-void *server_thread_pool_bounded_worker()
+void *server_thread_pool_bounded_worker(void *worker)
 {
+    affinity_pin_worker((int)(long)worker);
+
     /* Worker's main loop */
     while (1) {
+        int fd;
+
         pthread_mutex_lock(&mutex);
 
         /* if ring buffer is empty, wait master push data and send signal */
-        while (ring_buffer_is_empty(&ring_buffer) == 0) {
+        while (bounded_pool_is_empty()) {
             pthread_cond_wait(&master_cond, &mutex);
         }
 
-        int fd;
-        ring_buffer_pop(&ring_buffer, &fd); /* get file descriptor from ring buffer */
+        /*
+         * One at a time: client_process keeps the connection for as
+         * long as it is kept alive, so any other fd taken now would
+         * wait on it rather than go to the next free worker.
+         */
+        if (sjf_age) {
+            sjf_queue_pop(&sjf_queue, &fd); /* the smallest response, or one waiting too long */
+        } else {
+            ring_buffer_pop_int(&ring_buffer, &fd); /* get file descriptor from ring buffer */
+        }
         pthread_mutex_unlock(&mutex);
-        /* send signal if ring buffer is full and master is waiting for signal to wake up */
-        pthread_cond_signal(&worker_cond);
 
         client_process(fd);
     }
     pthread_exit(0);
 }
 
+/*
+ * Queue depth gauges of the thread pools, for the stats.
+ */
+unsigned long ring_buffer_depth(void)
+{
+    unsigned long n;
+
+    pthread_mutex_lock(&mutex);
+    n = sjf_age ? sjf_queue_count(&sjf_queue) : ring_buffer_count(&ring_buffer);
+    pthread_mutex_unlock(&mutex);
+    return n;
+}
+
+unsigned long mpmc_ring_depth(void)
+{
+    return mpmc_ring_size(&mpmc_ring);
+}
+
+unsigned long ws_pool_depth(void)
+{
+    return ws_pool_size(&ws_pool);
+}
+
+unsigned long elastic_pool_depth(void)
+{
+    return elastic_pool_size(&elastic_pool);
+}
+
 /*
  * The following implementations use a thread pool.  This collection
  * of threads is of maximum size MAX_CONCURRENCY, and is created by
@@ -167,8 +253,19 @@ server_thread_pool_bounded(int accept_fd)
 {
     int i = 0;
 
-    /* Init references */
-    ring_buffer_init(&ring_buffer, sizeof(int), MAX_DATA_SZ);
+    /* Init references: the size class queues take the ring's place */
+    if (sjf_age) {
+        if (sjf_queue_init(&sjf_queue, MAX_DATA_SZ, sjf_age)) {
+            printf("Could not allocate the size class queues\n");
+            return;
+        }
+    } else {
+        ring_buffer_init(&ring_buffer, sizeof(int), MAX_DATA_SZ);
+        if (!ring_buffer.begin) {
+            printf("Could not allocate the ring buffer\n");
+            return;
+        }
+    }
     pthread_t threads[MAX_CONCURRENCY];
     if(pthread_mutex_init(&mutex, NULL) != 0) {
         return -1; /* return if mutex init fails */
@@ -176,40 +273,468 @@ server_thread_pool_bounded(int accept_fd)
     if(pthread_cond_init(&master_cond, NULL) != 0) {
         return -1; /* return if master_cond init fails */
     }
-    if(pthread_cond_init(&worker_cond, NULL) != 0) {
-        return -1; /* return if worker_cond init fails */
-    }
+    stats_set_queue_depth(ring_buffer_depth);
 
     /* Create worker threads */
     for (i = 0; i < MAX_CONCURRENCY; ++i) {
-        pthread_create(&threads[i], NULL, server_thread_pool_bounded_worker, NULL);
+        pthread_create(&threads[i], NULL, server_thread_pool_bounded_worker, (void *)(long)i);
     }
 
     /* Starts main loop */
     while (1) {
-        int fd = server_accept(accept_fd);
+        int fds[POOL_BATCH], classes[POOL_BATCH];
+        size_t n = 0, queued, i;
+
+        /*
+         * Wait for a connection, then take the rest of a burst that
+         * is already waiting, and queue them all under one lock.
+         */
+        while (n < POOL_BATCH) {
+            int fd = client_next(accept_fd, n == 0);
+            if (fd >= 0) fds[n++] = fd;
+            else if (n) break;
+        }
 
-        pthread_mutex_lock(&mutex);
-        /* Check ring buffer, if it is full, then wait workers' signal */
-        while(ring_buffer_is_full(&ring_buffer) == 0) {
-            pthread_cond_wait(&worker_cond, &mutex);
+        /* the size of each response, before the lock, as it takes syscalls */
+        if (sjf_age) {
+            for (i = 0; i < n; i++) classes[i] = sjf_classify(fds[i]);
         }
 
-        ring_buffer_push(&fd, &ring_buffer);
+        pthread_mutex_lock(&mutex);
+        if (sjf_age) {
+            for (i = 0, queued = 0; i < n; i++) {
+                if (!sjf_queue_push(&sjf_queue, fds[i], classes[i])) {
+                    fds[i] = -1;
+                    queued++;
+                }
+            }
+        } else {
+            queued = ring_buffer_push_n(&ring_buffer, fds, n);
+            for (i = 0; i < queued; i++) fds[i] = -1;
+        }
 
         // Unlockes the mutex and send signal to workers..
         pthread_mutex_unlock(&mutex);
-        pthread_cond_signal(&master_cond);
+        if (queued > 1) {
+            pthread_cond_broadcast(&master_cond);
+        } else if (queued) {
+            pthread_cond_signal(&master_cond);
+        }
+
+        /*
+         * If the ring buffer is full, the workers are far behind:
+         * turn the connections away rather than stop accepting.
+         */
+        for (i = 0; i < n; i++) {
+            if (fds[i] < 0) continue;
+            server_shed(fds[i]);
+            server_release();
+        }
     }
 
     pthread_exit(0);
 }
 
+/*
+ * Lock-free pool worker: pops fds off the shared mpmc ring.  It spins
+ * briefly when the ring is empty and then parks on a futex, so no
+ * mutex is taken and only a worker that is actually asleep is woken.
+ */
+void *server_thread_pool_lockfree_worker(void *worker)
+{
+    affinity_pin_worker((int)(long)worker);
+
+    while (1) {
+        int fd = mpmc_ring_pop(&mpmc_ring);
+        client_process(fd);
+    }
+    pthread_exit(0);
+}
+
+/*
+ * Same structure as server_thread_pool_bounded, but the master and
+ * the workers hand off fds through a bounded ring synchronized with
+ * __cas instead of a mutex and two condition variables.
+ */
+void
+server_thread_pool_lockfree(int accept_fd)
+{
+    int i = 0;
+    pthread_t threads[MAX_CONCURRENCY];
+
+    if (mpmc_ring_init(&mpmc_ring, MAX_DATA_SZ)) {
+        printf("Could not allocate the lock-free ring\n");
+        return;
+    }
+    stats_set_queue_depth(mpmc_ring_depth);
+
+    /* Create worker threads */
+    for (i = 0; i < MAX_CONCURRENCY; ++i) {
+        pthread_create(&threads[i], NULL, server_thread_pool_lockfree_worker, (void *)(long)i);
+    }
+
+    /* Starts main loop */
+    while (1) {
+        int fd = client_next(accept_fd, 1);
+        if (fd < 0) continue;
+
+        /* waits (spin, then futex) only if the ring is full */
+        mpmc_ring_push(&mpmc_ring, fd);
+    }
+}
+
+/*
+ * Work-stealing pool worker: serves the fds queued on its own deque,
+ * and steals from the other workers' deques once its own is empty.
+ */
+void *server_thread_pool_stealing_worker(void *worker)
+{
+    affinity_pin_worker((int)(long)worker);
+
+    while (1) {
+        int fd = ws_pool_take(&ws_pool, (int)(long)worker);
+        client_process(fd);
+    }
+    pthread_exit(0);
+}
+
+/*
+ * Like server_thread_pool_lockfree, but rather than all of them
+ * sharing one ring, each worker has a deque of its own.  The master
+ * queues each fd on the least loaded worker's deque, so workers
+ * mostly touch only their own, and a worker stuck on a long response
+ * has what was queued behind it stolen by the idle ones.  With the
+ * workers pinned (-a), each fd goes to the worker on the CPU that
+ * took its packets (SO_INCOMING_CPU), as long as that one keeps up.
+ */
+void
+server_thread_pool_stealing(int accept_fd)
+{
+    long i;
+    pthread_t threads[MAX_CONCURRENCY];
+
+    if (ws_pool_init(&ws_pool, MAX_CONCURRENCY, MAX_DATA_SZ / MAX_CONCURRENCY)) {
+        printf("Could not allocate the work-stealing deques\n");
+        return;
+    }
+    stats_set_queue_depth(ws_pool_depth);
+
+    /* Create worker threads */
+    for (i = 0; i < MAX_CONCURRENCY; ++i) {
+        pthread_create(&threads[i], NULL, server_thread_pool_stealing_worker, (void *)i);
+    }
+
+    /* Starts main loop */
+    while (1) {
+        int fd = client_next(accept_fd, 1);
+        if (fd < 0) continue;
+
+        int worker = -1;
+
+        if (affinity_nworkers()) worker = affinity_worker_on(affinity_incoming_cpu(fd));
+        /* waits (spin, then futex) only if every deque is full */
+        ws_pool_push(&ws_pool, fd, worker);
+    }
+}
+
+/*
+ * Like server_thread_pool_bounded, but rather than MAX_CONCURRENCY
+ * workers, the pool keeps between elastic_min and elastic_max (-w),
+ * starting workers when connections queue up behind busy ones and
+ * retiring those that sit idle.
+ */
+void
+server_thread_pool_elastic(int accept_fd)
+{
+    if (elastic_pool_init(&elastic_pool, elastic_min, elastic_max, MAX_DATA_SZ,
+                          client_process)) {
+        printf("Could not start the elastic pool\n");
+        return;
+    }
+    stats_set_queue_depth(elastic_pool_depth);
+
+    /* Starts main loop */
+    while (1) {
+        int fd = client_next(accept_fd, 1);
+        if (fd < 0) continue;
+
+        /* starts a worker for fd if the ones there are can't keep up */
+        elastic_pool_push(&elastic_pool, fd);
+    }
+}
+
+struct reuseport_worker {
+    pthread_t thread;
+    int accept_fd;
+    int i;
+};
+
+/*
+ * Each reuseport worker runs its own event loop on its own listener.
+ * Pinned (-a), it asks the kernel for the connections whose packets
+ * its own CPU handles.
+ */
+void *server_reuseport_worker(void *arg)
+{
+    struct reuseport_worker *w = arg;
+    int cpu;
+
+    cpu = affinity_pin_worker(w->i);
+    if (cpu >= 0 && affinity_steer(w->accept_fd, cpu)) perror("setsockopt SO_INCOMING_CPU");
+    event_loop(w->accept_fd);
+    pthread_exit(0);
+}
+
+/*
+ * One SO_REUSEPORT listener and one event loop per core.  The kernel
+ * spreads new connections across the listeners, so every thread
+ * accepts and serves on its own, with no master thread and nothing
+ * shared between them.  accept_fd (created with
+ * server_create_reuseport) is used by the first thread.  With -a,
+ * there is a thread per CPU listed rather than per core.
+ */
+void
+server_reuseport(int accept_fd, short int port)
+{
+    int i, nthreads;
+    struct reuseport_worker *workers;
+
+    nthreads = affinity_nworkers();
+    if (!nthreads) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+
+    workers = malloc(nthreads * sizeof(struct reuseport_worker));
+    if (!workers) return;
+
+    for (i = 0; i < nthreads; i++) {
+        workers[i].accept_fd = i == 0 ? accept_fd : server_create_reuseport(port);
+        workers[i].i = i;
+        if (workers[i].accept_fd < 0) break;
+        pthread_create(&workers[i].thread, NULL, server_reuseport_worker, &workers[i]);
+    }
+    nthreads = i;
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
+}
+
+
+/* Serve from a pack of the directory, preloaded at startup (-p) */
+int preload;
+
+int disk_threads = DEFAULT_DISK_THREADS; /* -d */
+
+/* In the prefork supervisor, its worker processes (0 while there is none) */
+pid_t prefork_supervisor, *prefork_pids;
+int prefork_procs;
+unsigned long prefork_restarts;
+
+/*
+ * Signals are blocked in every thread and handled synchronously
+ * here, so the handling code can take locks and print freely.
+ *  SIGUSR1: print the content cache and allocation pool counters
+ *  SIGHUP:  reload the pack, if serving from one; requests keep being
+ *           served from the old one meanwhile
+ * The prefork supervisor passes both on to its workers.
+ */
+void *signal_thread(void *set)
+{
+    int sig, i;
+
+    while (1) {
+        if (sigwait((sigset_t *)set, &sig)) continue;
+
+        /* a prefork supervisor: the workers have caches and packs of their own */
+        if (prefork_pids) {
+            for (i = 0; i < prefork_procs; i++) {
+                if (prefork_pids[i] > 0) kill(prefork_pids[i], sig);
+            }
+            if (sig == SIGUSR1) {
+                printf("prefork: %d workers, %lu restarts\n",
+                       prefork_procs, prefork_restarts);
+                fflush(stdout);
+                continue;
+            }
+        }
+
+        if (sig == SIGHUP && preload) {
+            struct pack_stats ks;
+
+            if (pack_load()) {
+                printf("Could not reload the pack, keeping the old one\n");
+            } else {
+                pack_stats(&ks);
+                printf("pack: reloaded %lu files, %zu bytes\n", ks.files, ks.bytes);
+            }
+            fflush(stdout);
+        }
+        if (sig == SIGUSR1) {
+            struct content_cache_stats st;
+            struct pool_stats ps;
+            struct pack_stats ks;
+
+            content_cache_stats(&st);
+            printf("cache: %lu hits, %lu misses, %lu stale, %lu evictions, "
+                   "%lu compressed, %lu entries, %zu bytes\n",
+                   st.hits, st.misses, st.stale, st.evictions,
+                   st.compressed, st.entries, st.bytes);
+            shttp_req_stats(&ps);
+            printf("requests: %lu allocs, %lu frees, %lu slab mallocs, "
+                   "%zu bytes\n", ps.allocs, ps.frees, ps.slabs, ps.bytes);
+            event_conn_stats(&ps);
+            printf("connections: %lu allocs, %lu frees, %lu slab mallocs, "
+                   "%zu bytes\n", ps.allocs, ps.frees, ps.slabs, ps.bytes);
+            if (preload) {
+                pack_stats(&ks);
+                printf("pack: %lu files, %zu bytes, %lu loads\n",
+                       ks.files, ks.bytes, ks.reloads);
+            }
+            if (elastic_pool.max) {
+                struct elastic_pool_stats es;
+
+                elastic_pool_stats(&elastic_pool, &es);
+                printf("elastic pool: %d workers (%d-%d), %lu started, "
+                       "%lu retired, %lu us per connection\n", es.workers,
+                       es.min, es.max, es.grown, es.retired, es.service_us);
+            }
+            if (sjf_age) {
+                pthread_mutex_lock(&mutex);
+                printf("size classes: %lu %lu %lu %lu served, %lu ahead of "
+                       "smaller ones\n", sjf_queue.served[0], sjf_queue.served[1],
+                       sjf_queue.served[2], sjf_queue.served[3], sjf_queue.aged);
+                pthread_mutex_unlock(&mutex);
+            }
+            fflush(stdout);
+        }
+    }
+    pthread_exit(0);
+}
+
+/*
+ * Must run before any other thread is created, so that they all
+ * inherit the blocked signal mask.
+ */
+void
+signals_init(void)
+{
+    static sigset_t set;
+    pthread_t thread;
+
+    /* a client closing early must not take the server down */
+    signal(SIGPIPE, SIG_IGN);
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_create(&thread, NULL, signal_thread, &set);
+    pthread_detach(thread);
+}
+
+
+/*
+ * A prefork worker process: an epoll loop on the listener it shares
+ * with its siblings, and disk threads of its own.  Never returns.
+ */
+void
+server_prefork_worker(int accept_fd, int i)
+{
+    /* not to outlive the supervisor, even if it died before this */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != prefork_supervisor) _exit(0);
+
+    prefork_pids = NULL;
+    signals_init();
+    affinity_pin_worker(i);
+    if (content_cache_start()) {
+        printf("Could not start the compression thread\n");
+        _exit(1);
+    }
+    if (disk_pool_init(disk_threads)) {
+        printf("Could not start the disk threads\n");
+        _exit(1);
+    }
+    event_loop_exclusive(accept_fd);
+    _exit(1);
+}
+
+/*
+ * A supervisor process forks nprocs workers, which all accept on
+ * accept_fd, and forks a new one whenever one dies, so a crash while
+ * serving a request costs only that worker's connections.  The stats
+ * are kept in shared memory, so every worker answers with the totals.
+ */
+void
+server_prefork(int accept_fd, int nprocs)
+{
+    time_t *started;
+    pid_t *pids;
+    int i;
+
+    if (stats_share()) {
+        printf("Could not share the stats between processes\n");
+        return;
+    }
+    pids    = calloc(nprocs, sizeof(pid_t));
+    started = calloc(nprocs, sizeof(time_t));
+    if (!pids || !started) return;
+    prefork_supervisor = getpid();
+    prefork_procs      = nprocs;
+    prefork_pids       = pids;
+
+    while (1) {
+        int status;
+        pid_t pid;
+
+        for (i = 0; i < nprocs; i++) {
+            if (pids[i] > 0) continue;
+
+            /* one that dies right away mustn't have us forking nonstop */
+            if (time(NULL) - started[i] < 1) sleep(1);
+            started[i] = time(NULL);
+            fflush(stdout); /* or the worker prints it again */
+            pid = fork();
+            if (pid == 0) server_prefork_worker(accept_fd, i);
+            if (pid < 0) perror("fork");
+            pids[i] = pid;
+        }
+
+        pid = wait(&status);
+        if (pid < 0) {
+            if (errno != EINTR) sleep(1);
+            continue;
+        }
+        for (i = 0; i < nprocs && pids[i] != pid; i++) ;
+        if (i == nprocs) continue;
+
+        stats_reap(pid);
+        if (WIFSIGNALED(status)) {
+            printf("prefork: worker %d (pid %d) killed by signal %d, restarting\n",
+                   i, pid, WTERMSIG(status));
+        } else {
+            printf("prefork: worker %d (pid %d) exited with %d, restarting\n",
+                   i, pid, WEXITSTATUS(status));
+        }
+        fflush(stdout);
+        pids[i] = 0;
+        prefork_restarts++;
+    }
+}
+
 
 typedef enum {
     SERVER_TYPE_ONE = 0,
     SERVER_TYPE_THREAD_PER_REQUEST,
     SERVER_TYPE_THREAD_POOL_BOUND,
+    SERVER_TYPE_THREAD_POOL_LOCKFREE,
+    SERVER_TYPE_EVENT,
+    SERVER_TYPE_REUSEPORT,
+    SERVER_TYPE_URING,
+    SERVER_TYPE_THREAD_POOL_STEALING,
+    SERVER_TYPE_THREAD_POOL_ELASTIC,
+    SERVER_TYPE_PREFORK,
 } server_type_t;
 
 int
@@ -217,24 +742,165 @@ main(int argc, char *argv[])
 {
     server_type_t server_type;
     short int port;
-    int accept_fd;
+    int accept_fd, opt;
+    long cache_mb = DEFAULT_CACHE_MB;
+    int acceptor_cpu = -1;
+    int nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "A:a:b:c:d:k:m:n:pq:s:t:w:")) != -1) {
+        switch (opt) {
+        case 'A':
+            acceptor_cpu = atoi(optarg);
+            break;
+        case 'a':
+            if (affinity_set_workers(optarg)) argc = 0;
+            break;
+        case 'b':
+            server_backlog = atoi(optarg);
+            break;
+        case 'c':
+            cache_mb = atol(optarg);
+            break;
+        case 'd':
+            disk_threads = atoi(optarg);
+            break;
+        case 'k':
+            keepalive_timeout = atoi(optarg);
+            break;
+        case 'm':
+            server_max_conns = atoi(optarg);
+            break;
+        case 'n':
+            nprocs = atoi(optarg);
+            if (nprocs < 1) argc = 0;
+            break;
+        case 'p':
+            preload = 1;
+            break;
+        case 'q':
+            queue_budget = atoi(optarg);
+            break;
+        case 's':
+            sjf_age = atoi(optarg);
+            if (sjf_age < 0) argc = 0;
+            break;
+        case 't':
+            io_timeout = atoi(optarg);
+            break;
+        case 'w':
+            if (sscanf(optarg, "%d:%d", &elastic_min, &elastic_max) != 2 ||
+                elastic_min < 1 || elastic_max < elastic_min) {
+                argc = 0;
+            }
+            break;
+        default:
+            argc = 0; /* print the usage */
+        }
+    }
 
-    if (argc != 3) {
-        printf("Proper usage of http server is:\n%s <port> <#>\n"
+    if (argc - optind != 2) {
+        printf("Proper usage of http server is:\n%s [options] <port> <#>\n"
+               "options are\n"
+               "-A <cpu>: pin the thread accepting connections (and the "
+               "threads of mode 1) to cpu\n"
+               "-a <cpus>: pin the workers to these CPUs in turn, e.g. "
+               "0-3,8; mode 7 hands each connection to the worker on "
+               "the CPU that took its packets, and mode 5 runs a loop "
+               "on each, steered the same way\n"
+               "-b <n>: length of the queue of connections waiting to "
+               "be accepted (default %d)\n"
+               "-c <MB>: size of the in-memory content cache "
+               "(default %d, 0 disables it)\n"
+               "-d <n>: threads doing the file system work of modes 4-6, "
+               "so that their loops never block on the disk (default %d, "
+               "0 has the loops do it)\n"
+               "-k <s>: close idle persistent connections after this "
+               "many seconds (default %d, 0 disables keep-alive)\n"
+               "-m <n>: answer 503 to connections beyond n open at "
+               "once (per process; default 0, no limit)\n"
+               "-n <n>: worker processes of mode 9 (default one per "
+               "core)\n"
+               "-p: preload every file under the current directory into "
+               "memory at startup, and again on SIGHUP\n"
+               "-q <ms>: answer 503 to connections that waited longer "
+               "than this for a pool worker (default 0, no limit)\n"
+               "-s <ms>: mode 2 serves the queued connection with the "
+               "smallest response first, counting each as one size "
+               "class smaller for every ms it has waited (default 0, "
+               "in order)\n"
+               "-t <s>: close connections that take longer to send a "
+               "request head, or stop taking the response for this "
+               "long (default %d, 0 disables it)\n"
+               "-w <min>:<max>: bounds on the workers of mode 8 "
+               "(default %d:%d)\n"
                "port is the port to serve on, # is either\n"
                "0: serve only a single request\n"
                "1: serve each request with a new thread\n"
                "2: use a thread pool and a _bounded_ buffer with "
-               "mutexes + condition variables\n",
-               argv[0]);
+               "mutexes + condition variables\n"
+               "3: use a thread pool and a _bounded_ lock-free ring "
+               "synchronized with compare and swap\n"
+               "4: serve all connections from one thread with epoll "
+               "and non-blocking sockets\n"
+               "5: one SO_REUSEPORT listener and epoll loop per core\n"
+               "6: serve all connections from one thread with io_uring "
+               "(falls back to 4 without it)\n"
+               "7: use a thread pool with a work-stealing deque per "
+               "worker\n"
+               "8: use a thread pool that grows and shrinks with the "
+               "load (see -w)\n"
+               "9: prefork worker processes, each with an epoll loop on "
+               "the shared listener, restarted when they die (see -n)\n",
+               argv[0], DEFAULT_BACKLOG, DEFAULT_CACHE_MB,
+               DEFAULT_DISK_THREADS, DEFAULT_KEEPALIVE_TIMEOUT,
+               DEFAULT_IO_TIMEOUT, ELASTIC_MIN_WORKERS,
+               ELASTIC_MAX_WORKERS);
         return -1;
     }
 
-    port = atoi(argv[1]);
-    accept_fd = server_create(port);
+    port = atoi(argv[optind]);
+    server_type = atoi(argv[optind + 1]);
+
+    signals_init();
+    if (content_cache_init((size_t)cache_mb * 1024 * 1024)) {
+        printf("Could not allocate the content cache\n");
+        return -1;
+    }
+    /* prefork workers start their own, after the fork */
+    if (server_type != SERVER_TYPE_PREFORK && content_cache_start()) {
+        printf("Could not start the compression thread\n");
+        return -1;
+    }
+    if (preload) {
+        struct pack_stats ks;
+
+        if (pack_load()) {
+            printf("Could not preload the pack\n");
+            return -1;
+        }
+        pack_stats(&ks);
+        printf("pack: %lu files, %zu bytes\n", ks.files, ks.bytes);
+    }
+
+    /* only the event loops hand their disk work off */
+    if ((server_type == SERVER_TYPE_EVENT || server_type == SERVER_TYPE_REUSEPORT ||
+         server_type == SERVER_TYPE_URING) && disk_pool_init(disk_threads)) {
+        printf("Could not start the disk threads\n");
+        return -1;
+    }
+
+    if (server_type == SERVER_TYPE_REUSEPORT) {
+        accept_fd = server_create_reuseport(port);
+    } else {
+        accept_fd = server_create(port);
+    }
     if (accept_fd < 0) return -1;
 
-    server_type = atoi(argv[2]);
+    /* after the helper threads: they mustn't inherit this */
+    if (acceptor_cpu >= 0 && affinity_pin(acceptor_cpu)) {
+        printf("Could not pin the acceptor to CPU %d\n", acceptor_cpu);
+        return -1;
+    }
 
     switch(server_type) {
     case SERVER_TYPE_ONE:
@@ -246,6 +912,36 @@ main(int argc, char *argv[])
     case SERVER_TYPE_THREAD_POOL_BOUND:
         server_thread_pool_bounded(accept_fd);
         break;
+    case SERVER_TYPE_THREAD_POOL_LOCKFREE:
+        server_thread_pool_lockfree(accept_fd);
+        break;
+    case SERVER_TYPE_EVENT:
+        event_loop(accept_fd);
+        break;
+    case SERVER_TYPE_REUSEPORT:
+        server_reuseport(accept_fd, port);
+        break;
+    case SERVER_TYPE_URING:
+        switch (uring_loop(accept_fd)) {
+        case -1:
+            printf("io_uring is not available, using epoll instead\n");
+            event_loop(accept_fd);
+            break;
+        case -2:
+            close(accept_fd);
+            return -1;
+        }
+        break;
+    case SERVER_TYPE_THREAD_POOL_STEALING:
+        server_thread_pool_stealing(accept_fd);
+        break;
+    case SERVER_TYPE_THREAD_POOL_ELASTIC:
+        server_thread_pool_elastic(accept_fd);
+        break;
+    case SERVER_TYPE_PREFORK:
+        if (nprocs < 1) nprocs = 1;
+        server_prefork(accept_fd, nprocs);
+        break;
     }
     close(accept_fd);
 
@@ -0,0 +1,480 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ *
+ * Time the pieces the server is built from, each on its own: the
+ * ring_buffer, the mutex + condition variable handoff of the bounded
+ * thread pool, __cas under contention, and the per request parsing
+ * and response head.  Threads are pinned, each benchmark is warmed up
+ * and then repeated, and the mean ns/op is printed with its 95%
+ * confidence interval.
+ *
+ * usage: microbench [-a cpus] [-r repeats] [-w warmups] [-t threads] [-f filter]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <cas.h>
+#include <ring_buffer.h>
+#include <simple_http.h>
+#include <affinity.h>		/* affinity_pin_worker */
+
+#define MAX_THREADS 64
+/* Capacity of the rings, the size of the thread pool's (MAX_DATA_SZ) */
+#define RING_SZ 1024
+/* Elements per push_n/pop_n */
+#define BATCH 8
+
+struct bench {
+	const char *name;
+	/* Run iters operations, and return how long they took in ns */
+	double    (*run)(struct bench *b, long iters);
+	long        iters;	/* per run */
+	int         threads;	/* for the multi-threaded ones */
+	const char *head;	/* for the request ones */
+};
+
+static volatile int sink;
+
+static double
+now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/***
+ * ring_buffer: push and pop an fd, through each API, on a ring that
+ * stays half full so head and tail sweep the whole ring.
+ */
+
+static void
+ring_fill(ring_buffer_t *rb)
+{
+	int i;
+
+	ring_buffer_init(rb, sizeof(int), RING_SZ);
+	for (i = 0; i < RING_SZ / 2; i++) ring_buffer_push_int(rb, i);
+}
+
+static double
+ring_generic(struct bench *b, long iters)
+{
+	ring_buffer_t rb;
+	double t;
+	long i;
+	int fd = 0;
+
+	(void)b;
+	ring_fill(&rb);
+	t = now();
+	for (i = 0; i < iters; i++) {
+		ring_buffer_push(&fd, &rb);
+		ring_buffer_pop(&rb, &fd);
+	}
+	t = now() - t;
+	sink = fd;
+	free(rb.begin);
+	return t;
+}
+
+static double
+ring_int(struct bench *b, long iters)
+{
+	ring_buffer_t rb;
+	double t;
+	long i;
+	int fd = 0;
+
+	(void)b;
+	ring_fill(&rb);
+	t = now();
+	for (i = 0; i < iters; i++) {
+		ring_buffer_push_int(&rb, fd);
+		ring_buffer_pop_int(&rb, &fd);
+	}
+	t = now() - t;
+	sink = fd;
+	free(rb.begin);
+	return t;
+}
+
+/* One op is one fd, moved BATCH at a time */
+static double
+ring_batch(struct bench *b, long iters)
+{
+	ring_buffer_t rb;
+	int fds[BATCH] = { 0 };
+	double t;
+	long i;
+
+	(void)b;
+	ring_fill(&rb);
+	t = now();
+	for (i = 0; i < iters; i += BATCH) {
+		ring_buffer_push_n(&rb, fds, BATCH);
+		ring_buffer_pop_n(&rb, fds, BATCH);
+	}
+	t = now() - t;
+	sink = fds[0];
+	free(rb.begin);
+	return t;
+}
+
+/***
+ * The handoff of server_thread_pool_bounded: one thread pushes fds
+ * under the mutex, waiting on worker_cond while the ring is full and
+ * signaling master_cond, and the other pops them the other way round.
+ * One op is one fd handed over.
+ */
+
+struct handoff {
+	ring_buffer_t   rb;
+	pthread_mutex_t mutex;
+	pthread_cond_t  master_cond, worker_cond;
+	long            iters;
+};
+
+static void *
+handoff_worker(void *arg)
+{
+	struct handoff *h = arg;
+	long i;
+	int fd = 0;
+
+	affinity_pin_worker(1);
+	for (i = 0; i < h->iters; i++) {
+		pthread_mutex_lock(&h->mutex);
+		while (ring_buffer_is_empty(&h->rb) == 0) {
+			pthread_cond_wait(&h->master_cond, &h->mutex);
+		}
+		ring_buffer_pop_int(&h->rb, &fd);
+		pthread_mutex_unlock(&h->mutex);
+		pthread_cond_signal(&h->worker_cond);
+	}
+	sink = fd;
+	return NULL;
+}
+
+static double
+handoff(struct bench *b, long iters)
+{
+	struct handoff h;
+	pthread_t worker;
+	double t;
+	long i;
+
+	(void)b;
+	ring_buffer_init(&h.rb, sizeof(int), RING_SZ);
+	pthread_mutex_init(&h.mutex, NULL);
+	pthread_cond_init(&h.master_cond, NULL);
+	pthread_cond_init(&h.worker_cond, NULL);
+	h.iters = iters;
+
+	t = now();
+	if (pthread_create(&worker, NULL, handoff_worker, &h)) return -1;
+	for (i = 0; i < iters; i++) {
+		pthread_mutex_lock(&h.mutex);
+		while (ring_buffer_is_full(&h.rb) == 0) {
+			pthread_cond_wait(&h.worker_cond, &h.mutex);
+		}
+		ring_buffer_push_int(&h.rb, (int)i);
+		pthread_mutex_unlock(&h.mutex);
+		pthread_cond_signal(&h.master_cond);
+	}
+	pthread_join(worker, NULL);
+	t = now() - t;
+
+	pthread_cond_destroy(&h.worker_cond);
+	pthread_cond_destroy(&h.master_cond);
+	pthread_mutex_destroy(&h.mutex);
+	free(h.rb.begin);
+	return t;
+}
+
+/***
+ * __cas contention: each of b->threads threads increments one shared
+ * counter, retrying on failure, as the lock-free structures do with
+ * their indices.  One op is one successful increment, over all
+ * threads, so ns/op is the inverse of the counter's throughput.
+ */
+
+struct cas_arg {
+	pthread_t        thread;
+	int              i;
+	long             iters;
+	pthread_barrier_t *start;
+};
+
+static unsigned long counter __attribute__((aligned(64)));
+
+static void *
+cas_worker(void *arg)
+{
+	struct cas_arg *a = arg;
+	long i;
+
+	affinity_pin_worker(a->i);
+	pthread_barrier_wait(a->start);
+	for (i = 0; i < a->iters; i++) {
+		unsigned long old;
+
+		do {
+			old = counter;
+		} while (__cas(&counter, old, old + 1));
+	}
+	return NULL;
+}
+
+static double
+cas_contended(struct bench *b, long iters)
+{
+	struct cas_arg args[MAX_THREADS];
+	pthread_barrier_t start;
+	double t;
+	int i;
+
+	pthread_barrier_init(&start, NULL, b->threads + 1);
+	for (i = 0; i < b->threads; i++) {
+		args[i].i     = i;
+		args[i].iters = iters / b->threads;
+		args[i].start = &start;
+		if (pthread_create(&args[i].thread, NULL, cas_worker, &args[i])) return -1;
+	}
+	pthread_barrier_wait(&start);
+	t = now();
+	for (i = 0; i < b->threads; i++) pthread_join(args[i].thread, NULL);
+	t = now() - t;
+	pthread_barrier_destroy(&start);
+	return t;
+}
+
+/***
+ * Per request: copying the head into a request and parsing out its
+ * path (shttp_alloc_req, shttp_parse_req), and formatting the head of
+ * a file's response (shttp_alloc_response_head, with a validator).
+ */
+
+static const char small_head[] =
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"\r\n";
+
+static const char browser_head[] =
+	"GET /static/css/site.css HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"Accept: text/css,*/*;q=0.1\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.17 "
+	"(KHTML, like Gecko) Chrome/24.0.1312.57 Safari/537.17\r\n"
+	"Referer: http://www.example.com/\r\n"
+	"Accept-Encoding: gzip,deflate,sdch\r\n"
+	"Accept-Language: en-US,en;q=0.8\r\n"
+	"Cookie: session=8d2f0c3a91b74e65a0c1f2d3e4b5a697; theme=dark\r\n"
+	"\r\n";
+
+static double
+parse_req(struct bench *b, long iters)
+{
+	int len = strlen(b->head);
+	double t;
+	long i;
+
+	t = now();
+	for (i = 0; i < iters; i++) {
+		struct http_req *r = shttp_alloc_req(-1, (char *)b->head, len);
+
+		if (!r || shttp_parse_req(r)) return -1;
+		sink = r->path[0];
+		shttp_free_req(r);
+	}
+	return now() - t;
+}
+
+static double
+response_head(struct bench *b, long iters)
+{
+	struct shttp_validator v;
+	struct http_req *r;
+	struct stat s;
+	double t;
+	long i;
+
+	memset(&s, 0, sizeof(s));
+	s.st_mtim.tv_sec  = 1360000000;
+	s.st_mtim.tv_nsec = 123456789;
+	s.st_size         = 48213;
+	shttp_validator(&v, &s);
+
+	r = shttp_alloc_req(-1, (char *)b->head, strlen(b->head));
+	if (!r || shttp_parse_req(r)) return -1;
+
+	t = now();
+	for (i = 0; i < iters; i++) {
+		if (shttp_alloc_response_head(r, r->resp_buf, s.st_size, &v)) return -1;
+		sink = r->resp_hd_len;
+	}
+	t = now() - t;
+
+	shttp_free_req(r);
+	return t;
+}
+
+/***
+ * Statistics over the repeated runs
+ */
+
+/* Two-sided 95% quantiles of Student's t, by degrees of freedom */
+static const double t95[] = {
+	0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+	2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+	2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+	2.042,
+};
+#define NT95 (int)(sizeof(t95) / sizeof(t95[0]))
+
+static void
+report(struct bench *b, double *ns, int n)
+{
+	double mean = 0, var = 0, min = ns[0], ci = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		mean += ns[i];
+		if (ns[i] < min) min = ns[i];
+	}
+	mean /= n;
+	if (n > 1) {
+		for (i = 0; i < n; i++) var += (ns[i] - mean) * (ns[i] - mean);
+		var /= n - 1;
+		ci = (n - 1 < NT95 ? t95[n - 1] : 1.960) * sqrt(var / n);
+	}
+	printf("%-28s %10.2f %10.2f %10.2f %9.1f%%\n",
+	       b->name, mean, ci, min, mean > 0 ? 100 * ci / mean : 0);
+	fflush(stdout);
+}
+
+/* Pin to the first CPU of the list, like a pool's worker 0 */
+static void
+bench_run(struct bench *b, int repeats, int warmups)
+{
+	double ns[repeats];
+	int i;
+
+	affinity_pin_worker(0);
+	for (i = 0; i < warmups; i++) b->run(b, b->iters);
+	for (i = 0; i < repeats; i++) {
+		double t = b->run(b, b->iters);
+
+		if (t < 0) {
+			printf("%-28s failed\n", b->name);
+			return;
+		}
+		ns[i] = t / b->iters;
+	}
+	report(b, ns, repeats);
+}
+
+/* Without -a, the threads are pinned to the CPUs we may run on, in turn */
+static int
+default_cpus(void)
+{
+	char list[CPU_SETSIZE * 5] = "", *p = list;
+	cpu_set_t set;
+	int c;
+
+	if (sched_getaffinity(0, sizeof(set), &set)) return -1;
+	for (c = 0; c < CPU_SETSIZE; c++) {
+		if (CPU_ISSET(c, &set)) p += sprintf(p, "%s%d", p == list ? "" : ",", c);
+	}
+	return affinity_set_workers(list);
+}
+
+static void
+usage(char *prog)
+{
+	printf("Usage: %s [options]\n"
+	       "-a <cpus>: CPUs to pin the threads to, in turn (default: all allowed)\n"
+	       "-r <n>: timed runs of each benchmark (default 10)\n"
+	       "-w <n>: untimed runs before those (default 2)\n"
+	       "-t <n>: most threads contending on __cas (default: one per CPU, at least 4)\n"
+	       "-f <s>: only the benchmarks whose name contains s\n",
+	       prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench benches[8 + MAX_THREADS];
+	char names[MAX_THREADS][32];
+	const char *filter = NULL;
+	int repeats = 10, warmups = 2, max_threads = 0;
+	int opt, n = 0, i;
+
+	while ((opt = getopt(argc, argv, "a:r:w:t:f:h")) != -1) {
+		switch (opt) {
+		case 'a':
+			if (affinity_set_workers(optarg)) {
+				printf("Bad CPU list %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'r': repeats = atoi(optarg); break;
+		case 'w': warmups = atoi(optarg); break;
+		case 't': max_threads = atoi(optarg); break;
+		case 'f': filter = optarg; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : -1;
+		}
+	}
+	if (repeats < 1) repeats = 1;
+	if (!affinity_nworkers() && default_cpus()) {
+		printf("Could not find the CPUs to run on\n");
+		return -1;
+	}
+	if (!max_threads) max_threads = affinity_nworkers() < 4 ? 4 : affinity_nworkers();
+	if (max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+
+	benches[n++] = (struct bench){ .name = "ring_buffer push+pop",     .run = ring_generic,  .iters = 10000000 };
+	benches[n++] = (struct bench){ .name = "ring_buffer int push+pop", .run = ring_int,      .iters = 10000000 };
+	benches[n++] = (struct bench){ .name = "ring_buffer push_n/pop_n", .run = ring_batch,    .iters = 10000000 };
+	benches[n++] = (struct bench){ .name = "mutex+cond handoff",       .run = handoff,       .iters = 1000000 };
+	/* powers of two, and the most threads asked for if it isn't one */
+	for (i = 1; i <= max_threads;
+	     i = i < max_threads && i * 2 > max_threads ? max_threads : i * 2) {
+		snprintf(names[i - 1], sizeof(names[0]), "__cas, %d thread%s", i, i > 1 ? "s" : "");
+		benches[n++] = (struct bench){ .name = names[i - 1], .run = cas_contended,
+					       .iters = 4000000, .threads = i };
+	}
+	benches[n++] = (struct bench){ .name = "parse, small head",   .run = parse_req,
+				       .iters = 2000000, .head = small_head };
+	benches[n++] = (struct bench){ .name = "parse, browser head", .run = parse_req,
+				       .iters = 2000000, .head = browser_head };
+	benches[n++] = (struct bench){ .name = "response head",       .run = response_head,
+				       .iters = 2000000, .head = small_head };
+
+	printf("%d timed runs of each after %d warmups, on %d CPU%s\n",
+	       repeats, warmups, affinity_nworkers(), affinity_nworkers() > 1 ? "s" : "");
+	printf("%-28s %10s %10s %10s %10s\n", "", "ns/op", "+- (95%)", "min", "+-/mean");
+	for (i = 0; i < n; i++) {
+		if (filter && !strstr(benches[i].name, filter)) continue;
+		bench_run(&benches[i], repeats, warmups);
+	}
+
+	return 0;
+}
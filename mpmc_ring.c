@@ -0,0 +1,174 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cas.h>
+#include <futex.h>
+#include <mpmc_ring.h>
+
+/* How many times to retry before going to sleep on the futex */
+#define MPMC_SPIN_LIMIT 128
+
+int mpmc_ring_init(mpmc_ring_t *ring, size_t element_capacity)
+{
+    unsigned long capacity = 2, i;
+
+    while (capacity < element_capacity) capacity <<= 1;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->cells = malloc(capacity * sizeof(mpmc_cell_t));
+    if (!ring->cells) return -1;
+
+    /* slot i is free for the producer that claims position i */
+    for (i = 0; i < capacity; i++) {
+        ring->cells[i].seq = i;
+    }
+    ring->mask = capacity - 1;
+
+    /* spinning only pays off if the other side can run meanwhile */
+    ring->spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MPMC_SPIN_LIMIT : 0;
+    return 0;
+}
+
+/*
+ * Each cell's seq is the position it is waiting for:
+ *  seq == pos     : empty, the producer at pos may fill it
+ *  seq == pos + 1 : full, the consumer at pos may drain it
+ * after which the consumer hands it to the producer one lap ahead by
+ * setting seq to pos + capacity.
+ */
+int mpmc_ring_try_push(mpmc_ring_t *ring, int data)
+{
+    mpmc_cell_t *cell;
+    unsigned long pos, seq;
+    long diff;
+
+    pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &ring->cells[pos & ring->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)pos;
+
+        if (diff == 0) {
+            /* the slot is ours if nobody moved enqueue_pos meanwhile */
+            if (!__cas(&ring->enqueue_pos, pos, pos + 1)) break;
+        } else if (diff < 0) {
+            return -1; /* a full lap behind: the ring is full */
+        }
+        pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    }
+
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int mpmc_ring_try_pop(mpmc_ring_t *ring, int *data)
+{
+    mpmc_cell_t *cell;
+    unsigned long pos, seq;
+    long diff;
+
+    pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &ring->cells[pos & ring->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)(pos + 1);
+
+        if (diff == 0) {
+            if (!__cas(&ring->dequeue_pos, pos, pos + 1)) break;
+        } else if (diff < 0) {
+            return -1; /* nothing published here yet: the ring is empty */
+        }
+        pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+    }
+
+    *data = cell->data;
+    __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Wake one sleeper on the futex word, if there is any.  The fence
+ * orders our push/pop before the read of the waiter count, pairing
+ * with the increment in ring_wait: either the sleeper sees our
+ * element, or we see the sleeper.
+ */
+static inline void
+ring_wake(unsigned int *word, unsigned int *waiters)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED) == 0) return;
+
+    __atomic_fetch_add(word, 1, __ATOMIC_SEQ_CST);
+    futex_wake(word, 1);
+}
+
+void mpmc_ring_push(mpmc_ring_t *ring, int data)
+{
+    unsigned int seen;
+    int spins = 0;
+
+    while (mpmc_ring_try_push(ring, data)) {
+        if (spins++ < ring->spin_limit) {
+            cpu_relax();
+            continue;
+        }
+
+        /* announce ourselves, then re-check before sleeping */
+        __atomic_fetch_add(&ring->full_waiters, 1, __ATOMIC_SEQ_CST);
+        seen = __atomic_load_n(&ring->not_full, __ATOMIC_SEQ_CST);
+        if (mpmc_ring_try_push(ring, data) == 0) {
+            __atomic_fetch_sub(&ring->full_waiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        futex_wait(&ring->not_full, seen);
+        __atomic_fetch_sub(&ring->full_waiters, 1, __ATOMIC_SEQ_CST);
+        spins = 0;
+    }
+
+    ring_wake(&ring->not_empty, &ring->empty_waiters);
+}
+
+int mpmc_ring_pop(mpmc_ring_t *ring)
+{
+    unsigned int seen;
+    int spins = 0;
+    int data;
+
+    while (mpmc_ring_try_pop(ring, &data)) {
+        if (spins++ < ring->spin_limit) {
+            cpu_relax();
+            continue;
+        }
+
+        __atomic_fetch_add(&ring->empty_waiters, 1, __ATOMIC_SEQ_CST);
+        seen = __atomic_load_n(&ring->not_empty, __ATOMIC_SEQ_CST);
+        if (mpmc_ring_try_pop(ring, &data) == 0) {
+            __atomic_fetch_sub(&ring->empty_waiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        futex_wait(&ring->not_empty, seen);
+        __atomic_fetch_sub(&ring->empty_waiters, 1, __ATOMIC_SEQ_CST);
+        spins = 0;
+    }
+
+    ring_wake(&ring->not_full, &ring->full_waiters);
+    return data;
+}
+
+size_t mpmc_ring_size(mpmc_ring_t *ring)
+{
+    unsigned long deq = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+    unsigned long enq = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+
+    return enq > deq ? enq - deq : 0;
+}
@@ -0,0 +1,74 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef MPMC_RING_H
+#define MPMC_RING_H
+
+#include <stddef.h>
+
+#define MPMC_CACHE_LINE 64
+
+/*
+ * A slot of the ring.  seq tells producers and consumers whose turn
+ * it is to use the slot (see mpmc_ring.c).
+ */
+typedef struct mpmc_cell_t {
+    unsigned long seq;
+    int data;
+} mpmc_cell_t;
+
+/*
+ * Bounded multi-producer/multi-consumer ring of file descriptors.
+ * Slots are claimed with __cas, so neither side takes a lock.  The
+ * producer and consumer indices live on their own cache lines so the
+ * acceptor and the workers do not bounce a single line between them.
+ */
+typedef struct mpmc_ring_t {
+    mpmc_cell_t *cells;
+    unsigned long mask; /* capacity - 1, capacity is a power of two */
+    int spin_limit; /* tries before parking, 0 on a uniprocessor */
+
+    unsigned long enqueue_pos __attribute__((aligned(MPMC_CACHE_LINE)));
+    /* futex word bumped when a slot frees up, and its sleepers */
+    unsigned int not_full;
+    unsigned int full_waiters;
+
+    unsigned long dequeue_pos __attribute__((aligned(MPMC_CACHE_LINE)));
+    /* futex word bumped when an element arrives, and its sleepers */
+    unsigned int not_empty;
+    unsigned int empty_waiters;
+} __attribute__((aligned(MPMC_CACHE_LINE))) mpmc_ring_t;
+
+/*
+ * Initialize the ring with room for at least element_capacity fds
+ * (rounded up to a power of two).  Return 0 on success, -1 otherwise.
+ */
+int mpmc_ring_init(mpmc_ring_t *ring, size_t element_capacity);
+
+/*
+ * Try to push/pop without waiting.
+ * Return 0 on success, -1 if the ring is full/empty.
+ */
+int mpmc_ring_try_push(mpmc_ring_t *ring, int data);
+int mpmc_ring_try_pop(mpmc_ring_t *ring, int *data);
+
+/*
+ * Push/pop, waiting while the ring is full/empty.  The caller spins
+ * for a short while first, then parks on a futex until the other side
+ * makes progress.
+ */
+void mpmc_ring_push(mpmc_ring_t *ring, int data);
+int mpmc_ring_pop(mpmc_ring_t *ring);
+
+/*
+ * Number of fds in the ring, counting those being pushed or popped
+ * right now.  Only a snapshot, for the stats.
+ */
+size_t mpmc_ring_size(mpmc_ring_t *ring);
+
+#endif
@@ -0,0 +1,489 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <content.h>
+#include <pack.h>
+
+#define PACK_HEAD_SZ   256
+#define PACK_MAX_DEPTH 16
+#define PACK_ALIGN     64
+/* how often a load checks on the pack two loads back */
+#define PACK_REAP_US   1000
+
+struct pack_entry {
+	unsigned long hash;
+	char         *path;
+	char         *data; /* in the pack's region */
+	int           len;
+	/* response heads, indexed by keep_alive */
+	char          head[2][PACK_HEAD_SZ];
+	int           head_len[2];
+	struct shttp_validator valid;
+};
+
+struct pack {
+	/* sorted by hash, then path */
+	struct pack_entry *entries;
+	int                nentries;
+
+	char              *region; /* all the files, read-only */
+	size_t             region_sz, bytes;
+	char              *names;
+
+	/* which of the readers' counts the requests using it are in */
+	unsigned int       gen;
+};
+
+/* 
+ * A thread's side of the packs: each thread counts the requests it
+ * answers from the packs on a cache line of its own.
+ */
+struct pack_reader {
+	/* odd while it looks current up and counts itself in */
+	unsigned long       epoch;
+	/* requests still using the packs of even and odd generation */
+	long                held[2];
+	struct pack_reader *next;      /* all of them: never freed */
+	struct pack_reader *next_free; /* those of exited threads */
+} __attribute__((aligned(64)));
+
+/* A file found by the walk, to be packed */
+struct pack_file {
+	char       *path;
+	struct stat st;
+};
+
+struct pack_walk {
+	struct pack_file *files;
+	int               nfiles, max_files;
+	size_t            names_sz;
+};
+
+/* 
+ * Readers never wait, nor write to a shared line.  A reader bumps its
+ * epoch to odd, loads current, counts itself in on held[] of the
+ * pack's generation, and bumps its epoch back to even.  pack_load
+ * swaps current, then waits for each reader that is odd to move on
+ * (pack_sync): those after it see the new pack, so from then on the
+ * old pack's count only goes down.  The old pack is then retired, and
+ * freed by whoever sees the count of its generation, over all the
+ * readers, drop to zero (pack_reap).  Two generations are enough: a
+ * load waits for the pack two loads back to be freed before it
+ * reuses that one's counts.
+ */
+static struct pack *current;
+static struct pack *retired[2];
+static unsigned int gens;
+/* serializes loads, and keeps current alive for pack_stats */
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long reloads;
+
+static struct pack_reader *readers, *free_readers;
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t readers_once = PTHREAD_ONCE_INIT;
+static pthread_key_t readers_key;
+static __thread struct pack_reader *reader;
+
+static unsigned long
+path_hash(char *path)
+{
+	unsigned long h = 14695981039346656037UL; /* FNV-1a */
+
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 1099511628211UL;
+	}
+	return h;
+}
+
+static void
+pack_free(struct pack *p)
+{
+	if (p->region) munmap(p->region, p->region_sz);
+	free(p->names);
+	free(p->entries);
+	free(p);
+}
+
+/* Thread exit: the next thread takes the reader over, counts and all */
+static void
+reader_exit(void *arg)
+{
+	struct pack_reader *rd = arg;
+
+	pthread_mutex_lock(&readers_lock);
+	rd->next_free = free_readers;
+	free_readers  = rd;
+	pthread_mutex_unlock(&readers_lock);
+}
+
+static void
+readers_key_create(void)
+{
+	pthread_key_create(&readers_key, reader_exit);
+}
+
+static struct pack_reader *
+pack_reader(void)
+{
+	struct pack_reader *rd;
+
+	if (reader) return reader;
+
+	pthread_once(&readers_once, readers_key_create);
+	pthread_mutex_lock(&readers_lock);
+	rd = free_readers;
+	if (rd) {
+		free_readers = rd->next_free;
+	} else if (!posix_memalign((void **)&rd, 64, sizeof(struct pack_reader))) {
+		memset(rd, 0, sizeof(struct pack_reader));
+		rd->next = readers;
+		/* loads walk the list without the lock */
+		__atomic_store_n(&readers, rd, __ATOMIC_RELEASE);
+	} else {
+		rd = NULL;
+	}
+	pthread_mutex_unlock(&readers_lock);
+	if (rd) pthread_setspecific(readers_key, rd);
+
+	return reader = rd;
+}
+
+/* Wait for the readers looking current up to be done with it */
+static void
+pack_sync(void)
+{
+	struct pack_reader *rd;
+
+	for (rd = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); rd; rd = rd->next) {
+		unsigned long e = __atomic_load_n(&rd->epoch, __ATOMIC_SEQ_CST);
+
+		if (!(e & 1)) continue;
+		while (__atomic_load_n(&rd->epoch, __ATOMIC_SEQ_CST) == e) sched_yield();
+	}
+}
+
+/* Free the retired pack of generation gen, if no request uses it */
+static void
+pack_reap(int gen)
+{
+	struct pack *p = __atomic_load_n(&retired[gen], __ATOMIC_SEQ_CST);
+	struct pack_reader *rd;
+	long held = 0;
+
+	if (!p) return;
+	for (rd = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); rd; rd = rd->next) {
+		held += __atomic_load_n(&rd->held[gen], __ATOMIC_SEQ_CST);
+	}
+	if (held) return;
+
+	/* whoever takes it out frees it */
+	if (__atomic_compare_exchange_n(&retired[gen], &p, NULL, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		pack_free(p);
+	}
+}
+
+/* A request is done with the pack it counted itself in on held */
+static void
+pack_release(void *held)
+{
+	if (__atomic_sub_fetch((long *)held, 1, __ATOMIC_SEQ_CST)) return;
+
+	/* there may be no one else left to free a retired pack */
+	if (__atomic_load_n(&retired[0], __ATOMIC_SEQ_CST)) pack_reap(0);
+	if (__atomic_load_n(&retired[1], __ATOMIC_SEQ_CST)) pack_reap(1);
+}
+
+static int
+walk_add(struct pack_walk *w, char *path, struct stat *s)
+{
+	if (w->nfiles == w->max_files) {
+		int max = w->max_files ? w->max_files * 2 : 64;
+		struct pack_file *f = realloc(w->files, max * sizeof(struct pack_file));
+
+		if (!f) return -1;
+		w->files     = f;
+		w->max_files = max;
+	}
+	w->files[w->nfiles].path = strdup(path);
+	if (!w->files[w->nfiles].path) return -1;
+	w->files[w->nfiles].st = *s;
+	w->nfiles++;
+	w->names_sz += strlen(path) + 1;
+
+	return 0;
+}
+
+/*
+ * Find the files to pack under dir, with paths as the requests name
+ * them (no leading "./").  Hidden files are skipped, as content_open
+ * won't serve paths starting with a '.' either.
+ */
+static int
+walk_dir(struct pack_walk *w, char *dir, int depth)
+{
+	struct dirent *de;
+	DIR *d;
+	int ret = 0;
+
+	if (depth > PACK_MAX_DEPTH) return 0;
+	d = opendir(dir[0] ? dir : ".");
+	if (!d) return 0;
+
+	while (!ret && (de = readdir(d))) {
+		char path[PATH_MAX];
+		struct stat s;
+
+		if (de->d_name[0] == '.') continue;
+		if (snprintf(path, sizeof(path), "%s%s%s", dir, dir[0] ? "/" : "",
+			     de->d_name) >= (int)sizeof(path)) continue;
+		if (stat(path, &s)) continue;
+
+		if (S_ISDIR(s.st_mode)) {
+			ret = walk_dir(w, path, depth + 1);
+		} else if (S_ISREG(s.st_mode) && s.st_size <= MAX_CONTENT_SZ) {
+			ret = walk_add(w, path, &s);
+		}
+	}
+	closedir(d);
+
+	return ret;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct pack_entry *x = a, *y = b;
+
+	if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+	return strcmp(x->path, y->path);
+}
+
+/* Read up to len bytes of the file at path into buf; return how many */
+static size_t
+read_file(char *path, char *buf, size_t len)
+{
+	size_t got = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return 0;
+	while (got < len) {
+		ssize_t ret = read(fd, buf + got, len - got);
+
+		if (ret <= 0) break;
+		got += ret;
+	}
+	close(fd);
+
+	return got;
+}
+
+/* Lay the walked files out in a new pack. */
+static struct pack *
+pack_build(struct pack_walk *w)
+{
+	struct pack *p;
+	char *name, *data;
+	size_t off = 0;
+	int i;
+
+	p = calloc(1, sizeof(struct pack));
+	if (!p) return NULL;
+	p->entries = calloc(w->nfiles ? w->nfiles : 1, sizeof(struct pack_entry));
+	p->names   = malloc(w->names_sz ? w->names_sz : 1);
+	if (!p->entries || !p->names) goto err;
+
+	for (i = 0; i < w->nfiles; i++) {
+		off += (w->files[i].st.st_size + PACK_ALIGN - 1) & ~(size_t)(PACK_ALIGN - 1);
+	}
+	if (off) {
+		p->region_sz = off;
+		p->region = mmap(NULL, p->region_sz, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p->region == MAP_FAILED) {
+			p->region = NULL;
+			goto err;
+		}
+	}
+
+	name = p->names;
+	data = p->region;
+	for (i = 0; i < w->nfiles; i++) {
+		struct pack_entry *e = &p->entries[p->nentries];
+		struct pack_file *f = &w->files[i];
+
+		strcpy(name, f->path);
+		e->path = name;
+		e->hash = path_hash(name);
+		e->data = data;
+		/* a file that shrank since the walk is packed as it is now */
+		e->len  = read_file(name, data, f->st.st_size);
+		shttp_validator(&e->valid, &f->st);
+		e->head_len[0] = shttp_format_response_head(e->head[0], PACK_HEAD_SZ, e->len, 0,
+							    &e->valid);
+		e->head_len[1] = shttp_format_response_head(e->head[1], PACK_HEAD_SZ, e->len, 1,
+							    &e->valid);
+
+		name += strlen(name) + 1;
+		data += (f->st.st_size + PACK_ALIGN - 1) & ~(size_t)(PACK_ALIGN - 1);
+		p->bytes += e->len;
+		p->nentries++;
+	}
+	if (p->region && mprotect(p->region, p->region_sz, PROT_READ)) goto err;
+
+	qsort(p->entries, p->nentries, sizeof(struct pack_entry), entry_cmp);
+
+	return p;
+err:
+	pack_free(p);
+	return NULL;
+}
+
+int
+pack_load(void)
+{
+	struct pack_walk w;
+	struct pack *p, *old = NULL;
+	int i, ret;
+
+	memset(&w, 0, sizeof(w));
+	pthread_mutex_lock(&load_lock);
+
+	ret = walk_dir(&w, "", 0);
+	p   = ret ? NULL : pack_build(&w);
+	if (p) {
+		p->gen = gens++ & 1;
+		/* the counts of p's generation are still the pack's two loads back? */
+		while (1) {
+			pack_reap(p->gen);
+			if (!__atomic_load_n(&retired[p->gen], __ATOMIC_SEQ_CST)) break;
+			usleep(PACK_REAP_US);
+		}
+
+		old = current;
+		__atomic_store_n(&current, p, __ATOMIC_SEQ_CST);
+		reloads++;
+		if (old) {
+			/* requests still using the old pack are counted in */
+			pack_sync();
+			__atomic_store_n(&retired[old->gen], old, __ATOMIC_SEQ_CST);
+			pack_reap(old->gen);
+		}
+	}
+	pthread_mutex_unlock(&load_lock);
+
+	for (i = 0; i < w.nfiles; i++) free(w.files[i].path);
+	free(w.files);
+
+	return p ? 0 : -1;
+}
+
+static struct pack_entry *
+pack_find(struct pack *p, char *path)
+{
+	unsigned long h = path_hash(path);
+	int lo = 0, hi = p->nentries;
+
+	/* the first entry with a hash of at least h */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (p->entries[mid].hash < h) lo = mid + 1;
+		else                          hi = mid;
+	}
+	for (; lo < p->nentries && p->entries[lo].hash == h; lo++) {
+		if (!strcmp(p->entries[lo].path, path)) return &p->entries[lo];
+	}
+	return NULL;
+}
+
+int
+pack_respond(struct http_req *r)
+{
+	struct pack_reader *rd = pack_reader();
+	struct pack_entry *e;
+	struct pack *p;
+	long *held = NULL;
+
+	if (!rd) return -1;
+	__atomic_store_n(&rd->epoch, rd->epoch + 1, __ATOMIC_SEQ_CST);
+	p = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+	if (p) {
+		held = &rd->held[p->gen];
+		__atomic_add_fetch(held, 1, __ATOMIC_SEQ_CST);
+	}
+	__atomic_store_n(&rd->epoch, rd->epoch + 1, __ATOMIC_RELEASE);
+	if (!p) return -1;
+
+	e = pack_find(p, r->path);
+	if (!e || e->head_len[r->keep_alive] < 0) {
+		pack_release(held);
+		return -1;
+	}
+	if (shttp_conditional(r) && shttp_not_modified(r, &e->valid)) {
+		int ret = shttp_alloc_not_modified(r, &e->valid);
+
+		pack_release(held);
+		return ret;
+	}
+
+	r->resp_head    = e->head[r->keep_alive];
+	r->resp_hd_len  = e->head_len[r->keep_alive];
+	r->response     = e->data;
+	r->resp_len     = e->len;
+	r->resp_release = pack_release;
+	r->resp_owner   = held;
+
+	return 0;
+}
+
+int
+pack_size(char *path, off_t *size)
+{
+	struct pack_reader *rd = pack_reader();
+	struct pack_entry *e = NULL;
+	struct pack *p;
+
+	if (!rd) return -1;
+	/* a lookup short enough to be done within the epoch */
+	__atomic_store_n(&rd->epoch, rd->epoch + 1, __ATOMIC_SEQ_CST);
+	p = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+	if (p) e = pack_find(p, path);
+	if (e) *size = e->len;
+	__atomic_store_n(&rd->epoch, rd->epoch + 1, __ATOMIC_RELEASE);
+
+	return e ? 0 : -1;
+}
+
+void
+pack_stats(struct pack_stats *s)
+{
+	memset(s, 0, sizeof(struct pack_stats));
+
+	pthread_mutex_lock(&load_lock);
+	if (current) {
+		s->files = current->nentries;
+		s->bytes = current->bytes;
+	}
+	s->reloads = reloads;
+	pthread_mutex_unlock(&load_lock);
+}
@@ -0,0 +1,48 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+
+#include <simple_http.h>
+
+struct pack_stats {
+	unsigned long files; /* in the current pack */
+	size_t        bytes; /* of file data in it */
+	unsigned long reloads;
+};
+
+/*
+ * Read every file under the served directory (the current one) of at
+ * most MAX_CONTENT_SZ bytes into one read-only region, with an index
+ * from path to the file's bytes and prebuilt response heads, and
+ * serve from it from now on.  Calling it again builds a new pack and
+ * swaps it in: requests being served carry on with the old one, and
+ * none of them wait for the new.  Return -1 (keeping the old pack, if
+ * any) on error.
+ */
+int pack_load(void);
+
+/*
+ * Point the response of r at the packed copy of r->path.  Return 0
+ * if r now holds a reference to the pack, which shttp_free_req
+ * releases, or -1 if the path isn't packed (or there is no pack).
+ */
+int pack_respond(struct http_req *r);
+
+/*
+ * Set size to that of the packed copy of path.  Return -1 if the path
+ * isn't packed (or there is no pack).
+ */
+int pack_size(char *path, off_t *size);
+
+void pack_stats(struct pack_stats *s);
+
+#endif
@@ -0,0 +1,199 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ *
+ * Time the request parser against the scalar one it replaced, on a
+ * few request heads, both whole and arriving a segment at a time.
+ *
+ * usage: parse_bench [-n iterations]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <http_parse.h>
+
+#define MAX_HEAD 1024
+
+static const char *heads[] = {
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"\r\n",
+
+	"GET /static/img/logo.png HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"User-Agent: curl/7.29.0\r\n"
+	"Accept: */*\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n",
+
+	"GET /articles/2013/02/parsing-http-requests-quickly.html HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"Cache-Control: max-age=0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.17 "
+	"(KHTML, like Gecko) Chrome/24.0.1312.57 Safari/537.17\r\n"
+	"Referer: http://www.example.com/articles/2013/02/\r\n"
+	"Accept-Encoding: gzip,deflate,sdch\r\n"
+	"Accept-Language: en-US,en;q=0.8\r\n"
+	"Accept-Charset: ISO-8859-1,utf-8;q=0.7,*;q=0.3\r\n"
+	"Cookie: session=8d2f0c3a91b74e65a0c1f2d3e4b5a697; theme=dark; lang=en\r\n"
+	"If-None-Match: \"5118d3a1-2c4f\"\r\n"
+	"Range: bytes=0-1023\r\n"
+	"\r\n",
+};
+#define NHEADS (int)(sizeof(heads) / sizeof(heads[0]))
+
+/* Bytes per read when the head arrives in pieces */
+#define SEGMENT 64
+
+/*
+ * The scalar path the server used before http_parse.c: memmem for the
+ * terminators, rescanning from the start on every read, then strchr
+ * and strncasecmp through the copy of the head for its one header.
+ */
+static int
+old_req_len(char *buf, int len)
+{
+	char *crlf, *lf;
+
+	crlf = memmem(buf, len, "\r\n\r\n", 4);
+	lf   = memmem(buf, len, "\n\n", 2);
+
+	if (lf && (!crlf || lf < crlf)) return lf - buf + 2;
+	if (crlf) return crlf - buf + 4;
+	return 0;
+}
+
+static char *
+old_find_header(char *s, const char *name)
+{
+	int len = strlen(name);
+
+	while ((s = strchr(s, '\n'))) {
+		s++;
+		if (*s == '\r' || *s == '\n') break;
+		if (!strncasecmp(s, name, len)) {
+			s += len;
+			while (*s == ' ' || *s == '\t') s++;
+			return s;
+		}
+	}
+	return NULL;
+}
+
+static int
+old_parse(char *req)
+{
+	char *end, *version, *conn;
+	int keep_alive;
+
+	if (strncmp(req, "GET ", 4)) return -1;
+	end = req + 4;
+	while (*end != ' ' && *end != '\0') end++;
+	if (*end == '\0') return -1;
+	*end = '\0';
+
+	version    = end + 1;
+	keep_alive = !strncmp(version, "HTTP/1.1", 8);
+	conn       = old_find_header(version, "Connection:");
+	if (conn && !strncasecmp(conn, "close", 5)) keep_alive = 0;
+
+	return keep_alive;
+}
+
+static int
+new_parse(char *req, int len)
+{
+	struct shttp_head h;
+
+	if (shttp_parse_head(req, len, &h)) return -1;
+	return h.minor + h.connection.len + h.host.len;
+}
+
+/* Whether to feed the head in SEGMENT byte pieces, and which parser */
+struct bench {
+	const char *name;
+	int         segmented, new;
+};
+
+static volatile int sink;
+
+static double
+now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Return the nanoseconds per request of iters runs of b over head */
+static double
+run(struct bench *b, const char *head, long iters)
+{
+	char buf[MAX_HEAD + 1], req[MAX_HEAD + 1];
+	int hlen = strlen(head);
+	double t;
+	long i;
+
+	memcpy(buf, head, hlen);
+	t = now();
+	for (i = 0; i < iters; i++) {
+		struct shttp_parser p = { 0, 0 };
+		int len = b->segmented ? 0 : hlen, found;
+
+		/* the reads that make the whole head arrive */
+		do {
+			if (b->segmented) len = len + SEGMENT < hlen ? len + SEGMENT : hlen;
+			found = b->new ? shttp_parse_len(&p, buf, len) : old_req_len(buf, len);
+		} while (!found);
+
+		/* the server parses its own, NUL-terminated, copy */
+		memcpy(req, buf, found);
+		req[found] = '\0';
+		sink = b->new ? new_parse(req, found) : old_parse(req);
+	}
+	return (now() - t) * 1e9 / iters;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench benches[] = {
+		{ "scalar",            0, 0 },
+		{ "simd",              0, 1 },
+		{ "scalar, segmented", 1, 0 },
+		{ "simd, segmented",   1, 1 },
+	};
+	long iters = 1000000;
+	int opt, i, j;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		if (opt == 'n') iters = atol(optarg);
+		else {
+			fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	printf("%-20s", "ns/request");
+	for (j = 0; j < NHEADS; j++) printf("%10d B", (int)strlen(heads[j]));
+	printf("\n");
+	for (i = 0; i < (int)(sizeof(benches) / sizeof(benches[0])); i++) {
+		printf("%-20s", benches[i].name);
+		for (j = 0; j < NHEADS; j++) printf("%12.1f", run(&benches[i], heads[j], iters));
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,182 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <pool.h>
+
+/* Objects per malloc when a pool runs dry */
+#define POOL_SLAB_OBJS 16
+#define POOL_ALIGN     16
+
+/*
+ * A slab starts with this header, followed by the objects.  Free
+ * objects are linked through their first word.
+ */
+struct slab {
+	struct slab *next;
+} __attribute__((aligned(POOL_ALIGN)));
+
+struct pool {
+	struct pool_type *type;
+	void             *free;
+	struct slab      *slabs;
+	size_t            obj_sz;
+
+	/* only ever written by the owning thread */
+	unsigned long     allocs, frees, nslabs;
+
+	struct pool      *next, *prev;
+};
+
+static __thread struct pool *local_pools[POOL_MAX_TYPES];
+
+static pthread_mutex_t types_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ntypes;
+
+/* Thread exit: hand the slabs back, keep the counters. */
+static void
+pool_destroy(void *arg)
+{
+	struct pool *p = arg;
+	struct pool_type *t = p->type;
+	struct slab *s;
+
+	pthread_mutex_lock(&t->lock);
+	if (p->prev) p->prev->next = p->next;
+	else         t->pools      = p->next;
+	if (p->next) p->next->prev = p->prev;
+	t->retired_allocs += p->allocs;
+	t->retired_frees  += p->frees;
+	t->retired_slabs  += p->nslabs;
+	pthread_mutex_unlock(&t->lock);
+
+	while ((s = p->slabs)) {
+		p->slabs = s->next;
+		free(s);
+	}
+	free(p);
+}
+
+static int
+pool_type_setup(struct pool_type *t)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&types_lock);
+	if (!t->ready) {
+		if (ntypes == POOL_MAX_TYPES ||
+		    pthread_key_create(&t->key, pool_destroy)) {
+			ret = -1;
+		} else {
+			t->id = ntypes++;
+			t->obj_sz = (t->obj_sz + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+			__atomic_store_n(&t->ready, 1, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&types_lock);
+
+	return ret;
+}
+
+/* First allocation of this type by this thread */
+static struct pool *
+pool_create(struct pool_type *t)
+{
+	struct pool *p;
+
+	if (!__atomic_load_n(&t->ready, __ATOMIC_ACQUIRE) && pool_type_setup(t)) return NULL;
+
+	p = malloc(sizeof(struct pool));
+	if (!p) return NULL;
+	memset(p, 0, sizeof(struct pool));
+	p->type   = t;
+	p->obj_sz = t->obj_sz;
+
+	pthread_mutex_lock(&t->lock);
+	p->next = t->pools;
+	if (p->next) p->next->prev = p;
+	t->pools = p;
+	pthread_mutex_unlock(&t->lock);
+
+	/* so that pool_destroy runs when the thread exits */
+	pthread_setspecific(t->key, p);
+	local_pools[t->id] = p;
+
+	return p;
+}
+
+static int
+pool_grow(struct pool *p)
+{
+	struct slab *s;
+	char *obj;
+	int i;
+
+	s = malloc(sizeof(struct slab) + POOL_SLAB_OBJS * p->obj_sz);
+	if (!s) return -1;
+	s->next  = p->slabs;
+	p->slabs = s;
+	p->nslabs++;
+
+	obj = (char *)(s + 1);
+	for (i = 0; i < POOL_SLAB_OBJS; i++, obj += p->obj_sz) {
+		*(void **)obj = p->free;
+		p->free = obj;
+	}
+	return 0;
+}
+
+void *
+pool_alloc(struct pool_type *t)
+{
+	struct pool *p = t->ready ? local_pools[t->id] : NULL;
+	void *obj;
+
+	if (!p && !(p = pool_create(t))) return NULL;
+	if (!p->free && pool_grow(p)) return NULL;
+
+	obj     = p->free;
+	p->free = *(void **)obj;
+	p->allocs++;
+
+	return obj;
+}
+
+void
+pool_free(struct pool_type *t, void *obj)
+{
+	struct pool *p = local_pools[t->id];
+
+	*(void **)obj = p->free;
+	p->free = obj;
+	p->frees++;
+}
+
+void
+pool_stats(struct pool_type *t, struct pool_stats *s)
+{
+	struct pool *p;
+
+	memset(s, 0, sizeof(struct pool_stats));
+	if (!__atomic_load_n(&t->ready, __ATOMIC_ACQUIRE)) return;
+
+	pthread_mutex_lock(&t->lock);
+	s->allocs = t->retired_allocs;
+	s->frees  = t->retired_frees;
+	for (p = t->pools; p; p = p->next) {
+		s->allocs += p->allocs;
+		s->frees  += p->frees;
+		s->slabs  += p->nslabs;
+	}
+	s->bytes = s->slabs * (sizeof(struct slab) + POOL_SLAB_OBJS * t->obj_sz);
+	s->slabs += t->retired_slabs;
+	pthread_mutex_unlock(&t->lock);
+}
@@ -0,0 +1,56 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define POOL_MAX_TYPES 8
+
+struct pool;
+
+/*
+ * A kind of object (e.g. http_req) handed out from per-thread pools.
+ * Each thread that allocates gets its own pool: a free list refilled
+ * a slab at a time with malloc, so in steady state an allocation is
+ * a pop off the thread's own free list, and nothing is shared.
+ * Objects must be freed by the thread that allocated them.  A pool's
+ * slabs are given back to malloc when its thread exits.
+ */
+struct pool_type {
+	const char     *name;
+	size_t          obj_sz;
+
+	/* set up on first use */
+	int             ready, id;
+	pthread_key_t   key;
+	pthread_mutex_t lock;
+	struct pool    *pools;   /* of the live threads */
+	/* counters of the threads that exited */
+	unsigned long   retired_allocs, retired_frees, retired_slabs;
+};
+
+#define POOL_TYPE(n, sz) { .name = (n), .obj_sz = (sz), \
+			   .lock = PTHREAD_MUTEX_INITIALIZER }
+
+struct pool_stats {
+	unsigned long allocs; /* objects handed out */
+	unsigned long frees;  /* objects given back */
+	unsigned long slabs;  /* mallocs made to grow the pools */
+	size_t        bytes;  /* held in slabs */
+};
+
+void *pool_alloc(struct pool_type *t);
+void  pool_free(struct pool_type *t, void *obj);
+
+/* Sum up the counters of the pools of all threads. */
+void  pool_stats(struct pool_type *t, struct pool_stats *s);
+
+#endif
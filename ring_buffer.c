@@ -8,7 +8,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-//#include <string.h>
+#include <string.h>
 #include <ring_buffer.h>
 
 /*
@@ -16,58 +16,77 @@
  */
 void ring_buffer_init(ring_buffer_t *ring_buffer, size_t element_size, size_t element_capacity)
 {
+    size_t capacity = 1;
+
+    while (capacity < element_capacity) capacity <<= 1;
+
     /* Create a continues memory space */
-    ring_buffer->begin = malloc( (element_capacity + 1) * element_size);
-    ring_buffer->end = (char *)ring_buffer->begin + element_capacity * element_size;
-    ring_buffer->element_capacity = element_capacity;
-    ring_buffer->element_count = 0;
+    ring_buffer->begin = malloc(capacity * element_size);
+    ring_buffer->element_capacity = capacity;
     ring_buffer->element_size = element_size;
-    ring_buffer->head = ring_buffer->begin;
-    ring_buffer->tail = ring_buffer->begin;
+    ring_buffer->mask = capacity - 1;
+    ring_buffer->head = 0;
+    ring_buffer->tail = 0;
     return;
 }
 
 int ring_buffer_is_empty(ring_buffer_t *ring_buffer)
 {
-    if(ring_buffer->element_count == 0)
+    if(ring_buffer->head == ring_buffer->tail)
         return 0;
     return -1;
 }
 
 int ring_buffer_is_full(ring_buffer_t *ring_buffer)
 {
-    if(ring_buffer->element_count == ring_buffer->element_capacity)
+    if(ring_buffer_count(ring_buffer) == ring_buffer->element_capacity)
         return 0;
     return -1;
 }
 
 void ring_buffer_push(void *data, ring_buffer_t *ring_buffer)
 {
-    if(ring_buffer_is_full(ring_buffer) == 0) {
-        return;
-    }
-
-    memcpy(ring_buffer->head, data, ring_buffer->element_size);
-    ring_buffer->head = (char *)ring_buffer->head + ring_buffer->element_size;
-    if (ring_buffer->head == ring_buffer->end) {
-        ring_buffer->head = ring_buffer->begin;
-    }
-    ring_buffer->element_count++;
-    return;
+    ring_buffer_push_n(ring_buffer, data, 1);
 }
 
-
 void ring_buffer_pop(ring_buffer_t *ring_buffer, void *data)
 {
-    if (ring_buffer_is_empty(ring_buffer) == 0) {
-        return;
-    }
+    ring_buffer_pop_n(ring_buffer, data, 1);
+}
+
+size_t ring_buffer_push_n(ring_buffer_t *ring_buffer, const void *data, size_t n)
+{
+    size_t size = ring_buffer->element_size;
+    size_t room = ring_buffer->element_capacity - ring_buffer_count(ring_buffer);
+    size_t slot = ring_buffer->head & ring_buffer->mask;
+    size_t first;
+
+    if (n > room) n = room;
+
+    /* up to the end of the memory space, then the rest from its start */
+    first = ring_buffer->element_capacity - slot;
+    if (first > n) first = n;
+    memcpy((char *)ring_buffer->begin + slot * size, data, first * size);
+    memcpy(ring_buffer->begin, (const char *)data + first * size, (n - first) * size);
+
+    ring_buffer->head += n;
+    return n;
+}
+
+size_t ring_buffer_pop_n(ring_buffer_t *ring_buffer, void *data, size_t n)
+{
+    size_t size = ring_buffer->element_size;
+    size_t count = ring_buffer_count(ring_buffer);
+    size_t slot = ring_buffer->tail & ring_buffer->mask;
+    size_t first;
+
+    if (n > count) n = count;
 
-    memcpy(data, ring_buffer->tail, ring_buffer->element_size);
-    ring_buffer->tail = (char *)ring_buffer->tail + ring_buffer->element_size;
+    first = ring_buffer->element_capacity - slot;
+    if (first > n) first = n;
+    memcpy(data, (char *)ring_buffer->begin + slot * size, first * size);
+    memcpy((char *)data + first * size, ring_buffer->begin, (n - first) * size);
 
-    if (ring_buffer->tail == ring_buffer->end) {
-        ring_buffer->tail = ring_buffer->begin;
-    }
-    ring_buffer->element_count--;
+    ring_buffer->tail += n;
+    return n;
 }
@@ -9,24 +9,46 @@
 #ifndef RING_BUFFER_H
 #define RING_BUFFER_H
 
+#include <stddef.h>
+
+#define RING_BUFFER_CACHE_LINE 64
+
+/*
+ * A bounded FIFO of fixed size elements.  It does no locking of its
+ * own: the thread pools guard it with a mutex.
+ *
+ * The capacity is a power of two, so head and tail just count pushes
+ * and pops, and the slot of an index is index & mask; head - tail is
+ * the number of elements.  The producer only writes head, and the
+ * consumers only tail, each on its own cache line, so the acceptor
+ * and the workers do not bounce a single line between them.
+ */
 typedef struct ring_buffer_t {
-    /* element related number */
+    /* element related number, set by ring_buffer_init */
     size_t element_size; /* size of each data */
-    size_t element_count; /* number of elements */
-    size_t element_capacity; /* The max number of elements in ring buffer*/
-
-    /* ring buffer pointers */
-    void *head; /* The address of first data */
-    void *tail; /* The address of last data */
+    size_t element_capacity; /* The max number of elements, a power of two */
+    size_t mask; /* element_capacity - 1 */
     void *begin; /* The first address of the memory space */
-    void *end; /* The last address of the memory space */
-} ring_buffer_t;
+
+    size_t head __attribute__((aligned(RING_BUFFER_CACHE_LINE))); /* pushes so far */
+    size_t tail __attribute__((aligned(RING_BUFFER_CACHE_LINE))); /* pops so far */
+} __attribute__((aligned(RING_BUFFER_CACHE_LINE))) ring_buffer_t;
 
 /*
- * Initial ring buffer, with defined element capacity and element size
+ * Initial ring buffer, with room for at least element_capacity
+ * elements (rounded up to a power of two) of element_size.  begin is
+ * NULL if the memory could not be allocated.
  */
 void ring_buffer_init(ring_buffer_t *ring_buffer, size_t element_size, size_t element_capacity);
 
+/*
+ * Number of elements in the ring buffer
+ */
+static inline size_t ring_buffer_count(ring_buffer_t *ring_buffer)
+{
+    return ring_buffer->head - ring_buffer->tail;
+}
+
 /*
  * Check if the ring buffer is empty,
  * if it is empty, return 0
@@ -40,13 +62,55 @@ int ring_buffer_is_empty(ring_buffer_t *ring_buffer);
 int ring_buffer_is_full(ring_buffer_t *ring_buffer);
 
 /*
- * Push a data in to the ring buffer
+ * Push a data in to the ring buffer, unless it is full
  */
 void ring_buffer_push(void *data, ring_buffer_t *ring_buffer);
 
 /*
- * Pop a data from the ring buffer
+ * Pop a data from the ring buffer, unless it is empty
  */
 void ring_buffer_pop(ring_buffer_t *ring_buffer, void *data);
 
-#endif
\ No newline at end of file
+/*
+ * The oldest element, which pop would return, left in place.  NULL if
+ * the ring buffer is empty.
+ */
+static inline void *ring_buffer_peek(ring_buffer_t *ring_buffer)
+{
+    if (ring_buffer->head == ring_buffer->tail) return NULL;
+    return (char *)ring_buffer->begin +
+           (ring_buffer->tail & ring_buffer->mask) * ring_buffer->element_size;
+}
+
+/*
+ * Push as many of the n elements at data as there is room for, and
+ * pop up to n elements into data, in at most two copies each.  Return
+ * the number of elements pushed/popped.
+ */
+size_t ring_buffer_push_n(ring_buffer_t *ring_buffer, const void *data, size_t n);
+size_t ring_buffer_pop_n(ring_buffer_t *ring_buffer, void *data, size_t n);
+
+/*
+ * Typed fast paths for rings of ints (fds): a plain store and load
+ * instead of a memcpy of element_size.  Return 0 on success, -1 if
+ * the ring is full/empty.
+ */
+static inline int ring_buffer_push_int(ring_buffer_t *ring_buffer, int data)
+{
+    if (ring_buffer_count(ring_buffer) == ring_buffer->element_capacity) return -1;
+
+    ((int *)ring_buffer->begin)[ring_buffer->head & ring_buffer->mask] = data;
+    ring_buffer->head++;
+    return 0;
+}
+
+static inline int ring_buffer_pop_int(ring_buffer_t *ring_buffer, int *data)
+{
+    if (ring_buffer->head == ring_buffer->tail) return -1;
+
+    *data = ((int *)ring_buffer->begin)[ring_buffer->tail & ring_buffer->mask];
+    ring_buffer->tail++;
+    return 0;
+}
+
+#endif
@@ -14,24 +14,46 @@
 #include <stdio.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <malloc.h>
 #include <unistd.h>
+#include <sys/resource.h>
 
-/* 
- * Create the file descriptor to accept on.  Return -1 otherwise.
- */
-int 
-server_create(short int port)
+#include <server.h>
+#include <stats.h>
+#include <simple_http.h>
+
+/* Set from the command line (-b, -m) */
+int server_backlog = DEFAULT_BACKLOG;
+int server_max_conns;
+
+/* Connections admitted and not yet released, if there is a limit */
+static int open_conns;
+
+static int 
+server_listen(short int port, int reuseport)
 {
-	int fd;
+	int fd, one = 1;
 	struct sockaddr_in server;
 
 	if ((fd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
 		perror("Establishing socket");
 		return -1;
 	}
+	/* restarting on the port must not wait out the last run's TIME_WAITs */
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
+		perror("setsockopt SO_REUSEADDR");
+		close(fd);
+		return -1;
+	}
+	if (reuseport &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+		perror("setsockopt SO_REUSEPORT");
+		close(fd);
+		return -1;
+	}
 
 	server.sin_family      = AF_INET;
 	server.sin_port        = htons(port);
@@ -40,14 +62,38 @@ server_create(short int port)
 		perror("binding receive socket");
 		return -1;
 	}
-	listen(fd, 10);
+	/* the kernel caps it at net.core.somaxconn */
+	listen(fd, server_backlog);
 
 	return fd;
 }
 
+/* 
+ * Create the file descriptor to accept on.  Return -1 otherwise.
+ */
+int 
+server_create(short int port)
+{
+	return server_listen(port, 0);
+}
+
+/* 
+ * Like server_create, but any number of these may be bound to the
+ * same port (SO_REUSEPORT), and the kernel spreads incoming
+ * connections across them.  Every listener on the port must be
+ * created this way.
+ */
+int 
+server_create_reuseport(short int port)
+{
+	return server_listen(port, 1);
+}
+
 /* 
  * Pass in the accept file descriptor returned from
- * server_create. Return a new file descriptor or -1 on error.
+ * server_create. Return a new file descriptor or -1 on error, or if
+ * the connection was turned away (server_admit).  The connection is
+ * counted, and timed until a worker picks it up.
  */
 int 
 server_accept(int fd)
@@ -61,6 +107,97 @@ server_accept(int fd)
 		perror("accept");
 		return -1;
 	}
+	stats_accepted(new_fd);
+	if (server_admit(new_fd)) return -1;
 	return new_fd;
 }
 
+
+/* 
+ * Put the file descriptor into non-blocking mode, so that reads,
+ * writes and accepts return EAGAIN rather than waiting.  Return -1
+ * on error.
+ */
+int
+server_set_nonblock(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("fcntl O_NONBLOCK");
+		return -1;
+	}
+	return 0;
+}
+
+/* 
+ * Send small writes right away rather than waiting for the client to
+ * ack what is in flight (Nagle).  On a persistent connection, a
+ * response otherwise sits out the client's delayed ack.  Return -1
+ * on error.
+ */
+int
+server_set_nodelay(int fd)
+{
+	int one = 1;
+
+	return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* 
+ * A server holding many connections open at once needs an fd for
+ * each, so allow as many as we are permitted.
+ */
+void
+server_raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl)) return;
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+/* 
+ * Count the new connection fd against server_max_conns.  Once that
+ * many are open, turn it away (server_shed) and return -1.  Each
+ * admitted connection must be released as it is closed.
+ */
+int
+server_admit(int fd)
+{
+	if (!server_max_conns) return 0;
+	if (__atomic_add_fetch(&open_conns, 1, __ATOMIC_RELAXED) <= server_max_conns) return 0;
+
+	__atomic_sub_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+	server_shed(fd);
+	return -1;
+}
+
+void
+server_release(void)
+{
+	if (server_max_conns) __atomic_sub_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+}
+
+/* 
+ * Answer 503 on fd without waiting for anything, and close it.
+ * Whatever the client sent is read first where it already arrived:
+ * closing with unread data resets the connection, and the client
+ * might lose the answer.
+ */
+void
+server_shed(int fd)
+{
+	char buf[MAX_REQ_SZ];
+	int i;
+
+	stats_add(STAT_SHED, 1);
+	if (send(fd, shttp_unavailable, shttp_unavailable_len,
+		 MSG_DONTWAIT | MSG_NOSIGNAL) == shttp_unavailable_len) {
+		shutdown(fd, SHUT_WR);
+	}
+	for (i = 0; i < 4 && recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0; i++) ;
+	close(fd);
+}
@@ -9,7 +9,21 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+/* Default length of the queue of connections waiting to be accepted */
+#define DEFAULT_BACKLOG 1024
+
+extern int server_backlog;
+/* Most connections open at once (0: no limit) */
+extern int server_max_conns;
+
 int server_create(short int port);
+int server_create_reuseport(short int port);
 int server_accept(int fd);
+int server_set_nonblock(int fd);
+int server_set_nodelay(int fd);
+void server_raise_fd_limit(void);
+int server_admit(int fd);
+void server_release(void);
+void server_shed(int fd);
 
 #endif
@@ -6,28 +6,40 @@
  * Author: Gabriel Parmer, gparmer@gwu.edu, 2012
  */
 
+#define _GNU_SOURCE
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
 
 #include <simple_http.h>
+#include <pool.h>
+
+static struct pool_type req_pool = POOL_TYPE("http_req", sizeof(struct http_req));
 
 struct http_req *
-shttp_alloc_req(int fd, char *request)
+shttp_alloc_req(int fd, char *request, int len)
 {
 	struct http_req *r;
 	assert(request);
+	assert(len <= MAX_REQ_SZ);
 
-	r = malloc(sizeof(struct http_req));
+	r = pool_alloc(&req_pool);
 	if (!r) return NULL;
-	memset(r, 0, sizeof(struct http_req));
+	memset(r, 0, offsetof(struct http_req, resp_hd_buf));
 
-	r->request = request;
-	r->req_len = strlen(request);
+	memcpy(r->req_buf, request, len);
+	r->req_buf[len] = '\0';
+	r->request = r->req_buf;
+	r->req_len = len;
 	r->path = NULL;
 	r->fd = fd;
+	r->resp_fd = -1;
 
 	return r;
 }
@@ -36,82 +48,410 @@ void
 shttp_free_req(struct http_req *r)
 {
 	r->path = NULL;
-	if (r->request)   free(r->request);
-	if (r->response)  free(r->response);
-	if (r->resp_head) free(r->resp_head);
-	close(r->fd);
-	free(r);
+	if (r->resp_release) {
+		r->resp_release(r->resp_owner);
+	} else if (r->response && r->response != r->resp_buf) {
+		free(r->response);
+	}
+	if (r->resp_fd >= 0) close(r->resp_fd);
+	pool_free(&req_pool, r);
 }
 
-static inline char *
-find_whitespace(char *s) 
-{ 
-	assert(s);
-	while (*s != ' ' && *s != '\0') s++;
-	return s;
+void 
+shttp_req_stats(struct pool_stats *s)
+{
+	pool_stats(&req_pool, s);
+}
+
+/* Is the token (of len bytes) in the comma-separated list v? */
+static int
+list_has(struct shttp_str *v, const char *token)
+{
+	int len = strlen(token), i = 0;
+
+	while (i < v->len) {
+		int start, end;
+
+		while (i < v->len && (v->p[i] == ' ' || v->p[i] == '\t')) i++;
+		start = i;
+		while (i < v->len && v->p[i] != ',') i++;
+		end = i++;
+		while (end > start && (v->p[end - 1] == ' ' || v->p[end - 1] == '\t')) end--;
+
+		if (end - start == len && !strncasecmp(v->p + start, token, len)) return 1;
+	}
+	return 0;
 }
 
 /* 
  * Pass in the request.  Set the ->path field in r to point to the
- * path that is being requested.
+ * path that is being requested, and ->keep_alive to whether the
+ * client wants the connection kept open.
  */
 int 
-shttp_get_path(struct http_req *r)
+shttp_parse_req(struct http_req *r)
 {
-	char *curr, *end, *path;
+	struct shttp_head *h = &r->head;
+	char *path;
 
 	assert(r);
 	assert(r->request);
-	
-	if (strncmp(r->request, "GET ", strlen("GET "))) return -1;
-	path = curr = r->request + sizeof("GET ")-1;
 
-	end = find_whitespace(curr);
-	if (*end == '\0') return -1;
-	*end = '\0';
+	if (shttp_parse_head(r->request, r->req_len, h)) return -1;
+	if (h->method.len != 3 || memcmp(h->method.p, "GET", 3)) return -1;
 
+	/* the space after the path */
+	path = h->path.p;
+	path[h->path.len] = '\0';
 	if (*path == '/') path++;
 	r->path = path;
-	
+
+	/* HTTP/1.1 connections persist by default, earlier ones don't */
+	r->keep_alive = h->minor >= 1;
+	if (h->connection.p) {
+		if (list_has(&h->connection, "close"))           r->keep_alive = 0;
+		else if (list_has(&h->connection, "keep-alive")) r->keep_alive = 1;
+	}
+
+	return 0;
+}
+
+/* Is the ETag (of len bytes) in the If-None-Match list v? */
+static int
+etag_match(struct shttp_str *v, const char *etag, int len)
+{
+	int i = 0;
+
+	while (i < v->len) {
+		int start, end;
+
+		while (i < v->len && (v->p[i] == ' ' || v->p[i] == '\t')) i++;
+		start = i;
+		while (i < v->len && v->p[i] != ',') i++;
+		end = i++;
+		while (end > start && (v->p[end - 1] == ' ' || v->p[end - 1] == '\t')) end--;
+
+		if (end - start == 1 && v->p[start] == '*') return 1;
+		/* a weak comparison: W/"x" matches "x" */
+		if (end - start > 2 && !strncmp(v->p + start, "W/", 2)) start += 2;
+		if (end - start == len && !memcmp(v->p + start, etag, len)) return 1;
+	}
 	return 0;
 }
 
-static const char success_head[] =
-	"HTTP/1.1 200 OK\r\n"
-	"Date: Sat, 14 Feb 2008 14:59:00 GMT\r\n"
+#define HTTP_DATE_FMT "%a, %d %b %Y %H:%M:%S GMT"
+
+void
+shttp_validator(struct shttp_validator *v, struct stat *s)
+{
+	struct tm tm;
+
+	v->mtime    = s->st_mtim.tv_sec;
+	v->etag_len = snprintf(v->etag, SHTTP_ETAG_SZ, "\"%lx-%lx-%lx\"",
+			       (unsigned long)s->st_mtim.tv_sec,
+			       (unsigned long)s->st_mtim.tv_nsec,
+			       (unsigned long)s->st_size);
+	gmtime_r(&v->mtime, &tm);
+	v->lm_len = strftime(v->last_modified, SHTTP_DATE_SZ, HTTP_DATE_FMT, &tm);
+}
+
+int
+shttp_conditional(struct http_req *r)
+{
+	return r->head.if_none_match.p || r->head.if_modified_since.p;
+}
+
+int
+shttp_not_modified(struct http_req *r, struct shttp_validator *v)
+{
+	struct shttp_str *ims = &r->head.if_modified_since;
+	char date[SHTTP_DATE_SZ];
+	struct tm tm;
+
+	/* the ETags take precedence over the date */
+	if (r->head.if_none_match.p) {
+		return etag_match(&r->head.if_none_match, v->etag, v->etag_len);
+	}
+	if (!ims->p || ims->len >= SHTTP_DATE_SZ) return 0;
+
+	memcpy(date, ims->p, ims->len);
+	date[ims->len] = '\0';
+	memset(&tm, 0, sizeof(struct tm));
+	if (!strptime(date, HTTP_DATE_FMT, &tm)) return 0;
+
+	return v->mtime <= timegm(&tm);
+}
+
+/* 
+ * Heads are assembled from the pieces below, with no allocation and
+ * no printf.  A head that runs out of room is flagged, and formatting
+ * it fails at the end.
+ */
+struct head {
+	char *p, *end;
+	int   full;
+};
+
+const char shttp_unavailable[] =
+	"HTTP/1.1 503 Service Unavailable\r\n"
+	"Content-Length: 0\r\n"
+	"Retry-After: 1\r\n"
 	"Connection: close\r\n"
-	"Content-Length: ";
-#define MAX_DIGITS 128
+	"\r\n";
+const int shttp_unavailable_len = sizeof(shttp_unavailable) - 1;
+
+static const char status_ok[]           = "HTTP/1.1 200 OK\r\n";
+static const char status_partial[]      = "HTTP/1.1 206 Partial Content\r\n";
+static const char status_not_modified[] = "HTTP/1.1 304 Not Modified\r\n";
+static const char status_bad_range[]    = "HTTP/1.1 416 Range Not Satisfiable\r\n";
+
+static const char date_line[] = "Date: Sat, 14 Feb 2008 14:59:00 GMT\r\n";
+static const char connection_lines[2][25] = {
+	"Connection: close\r\n",
+	"Connection: keep-alive\r\n",
+};
+
+static inline void
+head_append(struct head *h, const char *s, int len)
+{
+	if (h->full || len > h->end - h->p) {
+		h->full = 1;
+		return;
+	}
+	memcpy(h->p, s, len);
+	h->p += len;
+}
+
+#define head_lit(h, s) head_append(h, s, sizeof(s) - 1)
+
+static inline void
+head_num(struct head *h, unsigned long long v)
+{
+	char tmp[20];
+	int  n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n && !h->full) head_append(h, &tmp[--n], 1);
+}
+
+/* The status line and the lines every response has */
+static void
+head_start(struct head *h, char *buf, int sz, const char *status, int status_len,
+	   int keep_alive)
+{
+	h->p    = buf;
+	h->end  = buf + sz;
+	h->full = 0;
+	head_append(h, status, status_len);
+	head_lit(h, date_line);
+	head_append(h, connection_lines[!!keep_alive], strlen(connection_lines[!!keep_alive]));
+}
+
+static void
+head_validator(struct head *h, struct shttp_validator *v)
+{
+	if (!v) return;
+
+	head_lit(h, "ETag: ");
+	head_append(h, v->etag, v->etag_len);
+	head_lit(h, "\r\nLast-Modified: ");
+	head_append(h, v->last_modified, v->lm_len);
+	head_lit(h, "\r\n");
+}
+
+/* End the head with its blank line, and return its length, or -1 */
+static int
+head_finish(struct head *h, char *buf)
+{
+	head_lit(h, "\r\n");
+	return h->full ? -1 : h->p - buf;
+}
 
 /* 
- * Creates the ->response field in r that includes "answer", but also
- * includes other data.
+ * Creates the head of the response in r's head buffer, for the
+ * "answer" of dlen bytes, which becomes the ->response field.
  */ 
 int 
-shttp_alloc_response_head(struct http_req *r, char *data, int dlen)
+shttp_alloc_response_head(struct http_req *r, char *data, off_t dlen,
+			  struct shttp_validator *v)
 {
-	int  head_sz, pre_sz, len_sz;
-	char len_str[MAX_DIGITS];
-	char *resp_hd;
-
 	r->response = data;
 	r->resp_len = dlen;
 
-	len_sz  = snprintf(len_str, MAX_DIGITS, "%d\r\n\r\n", r->resp_len);
-	if (len_sz < 1) return -1;
-	
-	pre_sz  = strlen(success_head);
-	assert(pre_sz > 0);
-	head_sz = pre_sz + len_sz;
-	assert(head_sz > 0);
-	resp_hd = malloc(head_sz);
-	if (!resp_hd)   return -1;
-
-	r->resp_head   = resp_hd;
-	r->resp_hd_len = head_sz;
-	
-	memcpy(resp_hd, success_head, pre_sz);
-	memcpy(resp_hd + pre_sz, len_str, len_sz);
+	r->resp_head   = r->resp_hd_buf;
+	r->resp_hd_len = shttp_format_response_head(r->resp_hd_buf, MAX_RESP_HD_SZ,
+						     dlen, r->keep_alive, v);
+	if (r->resp_hd_len < 0) return -1;
 
 	return 0;
 }
+
+int 
+shttp_format_response_head(char *buf, int sz, off_t rlen, int keep_alive,
+			   struct shttp_validator *v)
+{
+	return shttp_format_encoded_head(buf, sz, rlen, keep_alive, v, NULL);
+}
+
+int 
+shttp_format_encoded_head(char *buf, int sz, off_t rlen, int keep_alive,
+			  struct shttp_validator *v, const char *encoding)
+{
+	struct head h;
+
+	if (rlen < 0) return -1;
+
+	head_start(&h, buf, sz, status_ok, sizeof(status_ok) - 1, keep_alive);
+	head_lit(&h, "Content-Length: ");
+	head_num(&h, rlen);
+	head_lit(&h, "\r\n");
+	head_validator(&h, v);
+	if (encoding) {
+		/* caches must not hand this to clients that didn't ask for it */
+		head_lit(&h, "Content-Encoding: ");
+		head_append(&h, encoding, strlen(encoding));
+		head_lit(&h, "\r\nVary: Accept-Encoding\r\n");
+	} else if (v) {
+		/* 
+		 * A file, which can be sent in parts.  Clients that ask
+		 * for a coding may get one instead, so caches must not
+		 * hand this to them either.
+		 */
+		head_lit(&h, "Accept-Ranges: bytes\r\nVary: Accept-Encoding\r\n");
+	}
+
+	return head_finish(&h, buf);
+}
+
+int 
+shttp_alloc_not_modified(struct http_req *r, struct shttp_validator *v)
+{
+	struct head h;
+
+	r->response  = NULL;
+	r->resp_len  = 0;
+	r->resp_head = r->resp_hd_buf;
+
+	head_start(&h, r->resp_hd_buf, MAX_RESP_HD_SZ, status_not_modified,
+		   sizeof(status_not_modified) - 1, r->keep_alive);
+	head_validator(&h, v);
+	r->resp_hd_len = head_finish(&h, r->resp_hd_buf);
+
+	return r->resp_hd_len < 0 ? -1 : 0;
+}
+
+/* Parse the decimal number at the start of [*p, end) into *v */
+static int
+range_num(char **p, char *end, off_t *v)
+{
+	char *s = *p;
+
+	*v = 0;
+	for (; *p < end && **p >= '0' && **p <= '9'; (*p)++) {
+		if (*v > (LLONG_MAX - 9) / 10) return -1;
+		*v = *v * 10 + (**p - '0');
+	}
+	return *p == s ? -1 : 0;
+}
+
+/* Does If-Range (an ETag or a date) name the file with validator v? */
+static int
+if_range_match(struct shttp_str *ir, struct shttp_validator *v)
+{
+	/* only strong ETags may be used to stitch parts together */
+	if (ir->len && ir->p[0] == '"') {
+		return ir->len == v->etag_len && !memcmp(ir->p, v->etag, v->etag_len);
+	}
+	return ir->len == v->lm_len && !memcmp(ir->p, v->last_modified, v->lm_len);
+}
+
+int
+shttp_range(struct http_req *r, struct shttp_validator *v, off_t size,
+	    off_t *start, off_t *len)
+{
+	struct shttp_str *rg = &r->head.range;
+	char *p, *end;
+	off_t first, last;
+
+	if (!rg->p || rg->len < 6 || strncasecmp(rg->p, "bytes=", 6)) return 0;
+	/* the file changed since the client got the rest of it */
+	if (r->head.if_range.p && !if_range_match(&r->head.if_range, v)) return 0;
+
+	p   = rg->p + 6;
+	end = rg->p + rg->len;
+	while (p < end && *p == ' ') p++;
+	/* several ranges: we may send the whole thing instead */
+	if (memchr(p, ',', end - p)) return 0;
+
+	if (p < end && *p == '-') {
+		/* the last n bytes */
+		p++;
+		if (range_num(&p, end, &last) || p != end) return 0;
+		if (last == 0) return -1;
+		first = last > size ? 0 : size - last;
+		last  = size - 1;
+	} else {
+		if (range_num(&p, end, &first) || p == end || *p++ != '-') return 0;
+		if (p == end) {
+			last = size - 1;
+		} else {
+			if (range_num(&p, end, &last) || p != end || last < first) return 0;
+			if (last > size - 1) last = size - 1;
+		}
+	}
+	if (first >= size) return -1;
+
+	*start = first;
+	*len   = last - first + 1;
+
+	return 1;
+}
+
+int
+shttp_alloc_partial_head(struct http_req *r, off_t start, off_t len, off_t size,
+			 struct shttp_validator *v)
+{
+	struct head h;
+
+	r->resp_off  = start;
+	r->resp_len  = len;
+	r->resp_head = r->resp_hd_buf;
+
+	head_start(&h, r->resp_hd_buf, MAX_RESP_HD_SZ, status_partial,
+		   sizeof(status_partial) - 1, r->keep_alive);
+	head_lit(&h, "Content-Length: ");
+	head_num(&h, len);
+	head_lit(&h, "\r\nContent-Range: bytes ");
+	head_num(&h, start);
+	head_lit(&h, "-");
+	head_num(&h, start + len - 1);
+	head_lit(&h, "/");
+	head_num(&h, size);
+	head_lit(&h, "\r\n");
+	head_validator(&h, v);
+	r->resp_hd_len = head_finish(&h, r->resp_hd_buf);
+
+	return r->resp_hd_len < 0 ? -1 : 0;
+}
+
+int
+shttp_alloc_bad_range(struct http_req *r, off_t size)
+{
+	struct head h;
+
+	r->response  = NULL;
+	r->resp_len  = 0;
+	r->resp_head = r->resp_hd_buf;
+
+	head_start(&h, r->resp_hd_buf, MAX_RESP_HD_SZ, status_bad_range,
+		   sizeof(status_bad_range) - 1, r->keep_alive);
+	head_lit(&h, "Content-Length: 0\r\nContent-Range: bytes */");
+	head_num(&h, size);
+	head_lit(&h, "\r\n");
+	r->resp_hd_len = head_finish(&h, r->resp_hd_buf);
+
+	return r->resp_hd_len < 0 ? -1 : 0;
+}
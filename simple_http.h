@@ -9,6 +9,33 @@
 #ifndef SIMPLE_HTTP_H
 #define SIMPLE_HTTP_H
 
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <http_parse.h>
+
+/* Largest request we are willing to read off of a connection */
+#define MAX_REQ_SZ 1024
+/* Largest response head we generate */
+#define MAX_RESP_HD_SZ 256
+/* Room for a small body (the error page) kept in the request itself */
+#define MAX_RESP_BUF_SZ (MAX_REQ_SZ + 256)
+/* Room for the ETag and Last-Modified values, quotes and all */
+#define SHTTP_ETAG_SZ 64
+#define SHTTP_DATE_SZ 32
+
+/* 
+ * What a client can check its copy of a file against, so we can tell
+ * it that its copy is still good (304) rather than send it again.
+ */
+struct shttp_validator {
+	time_t mtime;
+	char   etag[SHTTP_ETAG_SZ];
+	char   last_modified[SHTTP_DATE_SZ];
+	int    etag_len, lm_len;
+};
+
 struct http_req {
 	int   fd;
 
@@ -16,34 +43,132 @@ struct http_req {
 	char *request;
 	int   req_len;
 	char *path; 		/* points to string inside of request */
+	int   keep_alive;	/* keep the connection open after this one */
+	struct shttp_head head;	/* views into ->request */
 
 	/* Response information */
 	char *resp_head, *response;
-	int   resp_hd_len, resp_len;
+	int   resp_hd_len;
+	off_t resp_len;
+	int   resp_fd;	/* if >= 0, send the body from this file instead */
+	off_t resp_off;	/* where in the file the body starts */
+
+	/* 
+	 * If set, the response and its head are borrowed (e.g. from
+	 * the content cache), and shttp_free_req calls
+	 * resp_release(resp_owner) instead of freeing them.
+	 */
+	void (*resp_release)(void *owner);
+	void  *resp_owner;
+
+	/* 
+	 * Buffers come last: they are not cleared on allocation.
+	 * ->request, the default ->resp_head, and a small ->response
+	 * live here, so a request needs no allocation of its own.
+	 */
+	char  resp_hd_buf[MAX_RESP_HD_SZ];
+	char  req_buf[MAX_REQ_SZ + 1];
+	char  resp_buf[MAX_RESP_BUF_SZ];
 };
 
 
 /* 
- * Allocate a new http_req for the file descriptor, and with the
- * specific request.
+ * The whole response turning a client away while we are overloaded:
+ * it is asked to come back in a second.
  */
-struct http_req *shttp_alloc_req(int fd, char *request);
+extern const char shttp_unavailable[];
+extern const int  shttp_unavailable_len;
+
+/* 
+ * Allocate a new http_req for the file descriptor, and with a copy of
+ * the specific request (of len bytes).  Requests come from a pool
+ * private to the calling thread, and must be freed on that thread.
+ */
+struct http_req *shttp_alloc_req(int fd, char *request, int len);
 
 /* 
  * Will free the memory for the request, response, and will close the
- * file descriptor.
+ * response file, if any.  The client file descriptor belongs to the
+ * connection, which may carry more requests, and is left open.
  */
 void shttp_free_req(struct http_req *r);
 
-/* populate the ->path filed in http_req */
-int shttp_get_path(struct http_req *r);
+/* 
+ * Parse the request into ->head, and populate the ->path field (NUL
+ * terminated inside of the request), and the ->keep_alive field from
+ * the HTTP version and Connection: header.  Return -1 if it isn't a
+ * well-formed GET.
+ */
+int shttp_parse_req(struct http_req *r);
 
 /* 
  * Take the answer, which is the response (of length len) to the
  * request with the given path, and formulate the response to be
- * written out to the client in ->response.  Note that answer will not
- * be freed by this function, and must be freed by the caller.
+ * written out to the client in ->response.  The head is built in
+ * ->resp_hd_buf, without allocating, and carries the validator v of
+ * the file answered with, if not NULL.  The answer is freed along
+ * with the request by shttp_free_req.
+ */
+int shttp_alloc_response_head(struct http_req *r, char *resp, off_t rlen,
+			      struct shttp_validator *v);
+
+/* 
+ * Format the response head for a body of rlen bytes into buf (of sz
+ * bytes), announcing whether the connection is kept alive, and the
+ * validator v if not NULL.  Return the length of the head, or -1 if
+ * it doesn't fit.
+ */
+int shttp_format_response_head(char *buf, int sz, off_t rlen, int keep_alive,
+			       struct shttp_validator *v);
+
+/* 
+ * The same, for a body in the given content coding (e.g. "gzip"),
+ * which the head announces.
+ */
+int shttp_format_encoded_head(char *buf, int sz, off_t rlen, int keep_alive,
+			      struct shttp_validator *v, const char *encoding);
+
+/* Fill in v, the ETag and Last-Modified of the file with stat s */
+void shttp_validator(struct shttp_validator *v, struct stat *s);
+
+/* 
+ * Return 1 if r is conditional (If-None-Match or If-Modified-Since),
+ * so it might be answered without the file.
+ */
+int shttp_conditional(struct http_req *r);
+
+/* 
+ * Return 1 if the copy the client has of the file with validator v
+ * is still good: one of its If-None-Match ETags is v's or, lacking
+ * those, the file is no newer than its If-Modified-Since.
  */
-int shttp_alloc_response_head(struct http_req *r, char *resp, int rlen);
+int shttp_not_modified(struct http_req *r, struct shttp_validator *v);
+
+/* Formulate a body-less 304 Not Modified response to r */
+int shttp_alloc_not_modified(struct http_req *r, struct shttp_validator *v);
+
+/* 
+ * Find the part of the file (of size bytes, with validator v) that
+ * the Range: header of r asks for.  Return 1 with start and len set
+ * if there is one, 0 if the whole file should be sent (no Range, one
+ * we don't serve, like several ranges, or an If-Range for an older
+ * version of the file), or -1 if the range is past the end of it.
+ */
+int shttp_range(struct http_req *r, struct shttp_validator *v, off_t size,
+		off_t *start, off_t *len);
+
+/* 
+ * Formulate the 206 Partial Content head for the len bytes at start
+ * of the file (of size bytes) r->resp_fd, and send only those.
+ */
+int shttp_alloc_partial_head(struct http_req *r, off_t start, off_t len, off_t size,
+			     struct shttp_validator *v);
+
+/* Formulate a body-less 416 response to r, for a file of size bytes */
+int shttp_alloc_bad_range(struct http_req *r, off_t size);
+
+struct pool_stats;
+/* Allocation counters of the request pools */
+void shttp_req_stats(struct pool_stats *s);
 
 #endif
@@ -0,0 +1,110 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include <simple_http.h>	/* shttp_parse_req */
+#include <content.h>		/* content_stat */
+#include <content_cache.h>	/* content_cache_size */
+#include <pack.h>		/* pack_size */
+#include <stats.h>		/* stats_now */
+#include <sjf_queue.h>
+
+int sjf_queue_init(sjf_queue_t *q, size_t capacity, unsigned long age_ms)
+{
+    int c;
+
+    for (c = 0; c < SJF_CLASSES; c++) {
+        ring_buffer_init(&q->classes[c], sizeof(struct sjf_entry), capacity);
+        if (!q->classes[c].begin) return -1;
+        q->served[c] = 0;
+    }
+    q->age_us = age_ms * 1000;
+    q->aged = 0;
+    return 0;
+}
+
+int sjf_classify(int fd)
+{
+    static const off_t bounds[SJF_CLASSES - 1] = SJF_CLASS_BOUNDS;
+    char buf[MAX_REQ_SZ];
+    struct http_req *r;
+    struct stat s;
+    off_t size;
+    ssize_t len;
+    int c = 0;
+
+    /* whatever of the request is already here, left for the worker to read */
+    len = recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+    if (len <= 0) return 0;
+
+    r = shttp_alloc_req(fd, buf, len);
+    if (!r) return 0;
+    if (shttp_parse_req(r)) goto done;
+
+    /* files in memory need no stat: that could wait on the disk */
+    if (pack_size(r->path, &size) && content_cache_size(r->path, &size)) {
+        if (content_stat(r->path, &s)) goto done;
+        size = s.st_size;
+    }
+    while (c < SJF_CLASSES - 1 && size > bounds[c]) c++;
+done:
+    shttp_free_req(r);
+
+    return c;
+}
+
+int sjf_queue_push(sjf_queue_t *q, int fd, int c)
+{
+    struct sjf_entry e = { .fd = fd, .queued = stats_now() };
+
+    if (ring_buffer_is_full(&q->classes[c]) == 0) return -1;
+    ring_buffer_push(&e, &q->classes[c]);
+    return 0;
+}
+
+int sjf_queue_pop(sjf_queue_t *q, int *fd)
+{
+    unsigned long now = stats_now();
+    struct sjf_entry e;
+    long rank, best_rank = 0;
+    int c, best = -1, smallest = -1;
+
+    for (c = 0; c < SJF_CLASSES; c++) {
+        struct sjf_entry *oldest = ring_buffer_peek(&q->classes[c]);
+
+        if (!oldest) continue;
+        if (smallest < 0) smallest = c;
+
+        /* its class, less one for every age_us it has waited */
+        rank = (long)(c * q->age_us) - (long)(now - oldest->queued);
+        if (best < 0 || rank < best_rank) {
+            best = c;
+            best_rank = rank;
+        }
+    }
+    if (best < 0) return -1;
+
+    ring_buffer_pop(&q->classes[best], &e);
+    q->served[best]++;
+    if (best != smallest) q->aged++;
+    *fd = e.fd;
+    return 0;
+}
+
+size_t sjf_queue_count(sjf_queue_t *q)
+{
+    size_t n = 0;
+    int c;
+
+    for (c = 0; c < SJF_CLASSES; c++) n += ring_buffer_count(&q->classes[c]);
+    return n;
+}
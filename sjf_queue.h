@@ -0,0 +1,68 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef SJF_QUEUE_H
+#define SJF_QUEUE_H
+
+#include <stddef.h>
+
+#include <ring_buffer.h>
+
+/*
+ * Size classes of the responses, by upper bound in bytes; the last
+ * class takes everything larger.  Connections whose request hasn't
+ * arrived yet, or names no file, go in the first.
+ */
+#define SJF_CLASSES 4
+#define SJF_CLASS_BOUNDS { 16 * 1024, 256 * 1024, 4 * 1024 * 1024 }
+
+/*
+ * A queue of fds for the bounded thread pool that serves the shortest
+ * job first: an fd is queued in the class of the size of the response
+ * its request asks for, and the next one out is the oldest of the
+ * smallest class, as in SRPT.  So that large ones are not starved,
+ * each class counts as one smaller for every age_ms its oldest fd has
+ * waited.  Like ring_buffer_t, it does no locking of its own.
+ */
+typedef struct sjf_queue_t {
+    ring_buffer_t classes[SJF_CLASSES]; /* of struct sjf_entry */
+    unsigned long age_us;
+
+    unsigned long served[SJF_CLASSES]; /* fds popped from each class */
+    unsigned long aged; /* popped ahead of a smaller class's */
+} sjf_queue_t;
+
+struct sjf_entry {
+    int fd;
+    unsigned long queued; /* stats_now() when it was pushed */
+};
+
+/*
+ * Initialize the queue with room for capacity fds in each class.
+ * Return 0 on success, -1 otherwise.
+ */
+int sjf_queue_init(sjf_queue_t *q, size_t capacity, unsigned long age_ms);
+
+/*
+ * Which class the response to the request waiting on fd falls in.
+ * The request is only peeked at, so it is still there to be read, and
+ * the size comes from the pack or the content cache, or failing those,
+ * the file's stat.  Never waits for the client.
+ */
+int sjf_classify(int fd);
+
+/* Queue fd in class c.  Return -1 if that class is full. */
+int sjf_queue_push(sjf_queue_t *q, int fd, int c);
+
+/* Take the next fd to serve.  Return -1 if there is none. */
+int sjf_queue_pop(sjf_queue_t *q, int *fd);
+
+/* Number of fds queued, over all classes */
+size_t sjf_queue_count(sjf_queue_t *q);
+
+#endif
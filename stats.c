@@ -0,0 +1,376 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <stats.h>
+
+/* Connections with fds past this aren't timed through the queue */
+#define STATS_MAX_FDS 65536
+/* Blocks for the threads of all processes sharing the stats */
+#define STATS_SHARED_BLOCKS 256
+
+__thread struct stats_worker *stats_local;
+
+static const char *counter_names[STAT_NCOUNTERS] = {
+	"connections", "requests", "bytes", "not_found", "errors", "shed",
+};
+static const char *hist_names[STAT_NHISTS] = {
+	"queue_us", "service_us",
+};
+
+/*
+ * The blocks of the live threads, and the sum of those of the threads
+ * that exited.  The lock is only taken when a thread starts or exits,
+ * and to read the stats.  Shared between processes (stats_share), the
+ * registry also holds the blocks themselves, and its lock is robust:
+ * a process may die holding it.
+ */
+struct stats_registry {
+	pthread_mutex_t      lock;
+	struct stats_worker *workers;
+	struct stats_worker  retired;
+	int                  next_id;
+
+	/* shared only */
+	struct stats_worker *free;
+	struct stats_worker  blocks[];
+};
+
+static struct stats_registry  local = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct stats_registry *reg   = &local;
+static pthread_key_t          worker_key;
+static pthread_once_t       worker_once = PTHREAD_ONCE_INIT;
+
+/*
+ * When each fd was accepted.  The acceptor writes the slot before it
+ * hands the fd over, and the worker reads it after, so the queue
+ * between them orders the two.
+ */
+static unsigned long accept_time[STATS_MAX_FDS];
+
+static unsigned long (*queue_depth)(void);
+
+static void
+worker_add(struct stats_worker *to, struct stats_worker *from)
+{
+	int i, j;
+
+	for (i = 0; i < STAT_NCOUNTERS; i++) {
+		to->counters[i] += __atomic_load_n(&from->counters[i], __ATOMIC_RELAXED);
+	}
+	for (i = 0; i < STAT_NHISTS; i++) {
+		for (j = 0; j < HIST_BUCKETS; j++) {
+			to->hists[i][j] += __atomic_load_n(&from->hists[i][j], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void
+reg_lock(void)
+{
+	/* its owner died mid-update: counts are never torn, so carry on */
+	if (pthread_mutex_lock(&reg->lock) == EOWNERDEAD) pthread_mutex_consistent(&reg->lock);
+}
+
+/* With the lock held: fold w's counts into the retired ones. */
+static void
+worker_retire(struct stats_worker *w)
+{
+	if (w->prev) w->prev->next = w->next;
+	else         reg->workers  = w->next;
+	if (w->next) w->next->prev = w->prev;
+	worker_add(&reg->retired, w);
+
+	if (reg != &local) {
+		w->next   = reg->free;
+		reg->free = w;
+	}
+}
+
+/* Thread exit */
+static void
+worker_exit(void *arg)
+{
+	reg_lock();
+	worker_retire(arg);
+	pthread_mutex_unlock(&reg->lock);
+	if (reg == &local) free(arg);
+}
+
+static void
+worker_key_create(void)
+{
+	pthread_key_create(&worker_key, worker_exit);
+}
+
+struct stats_worker *
+stats_worker_get(void)
+{
+	struct stats_worker *w;
+
+	if (stats_local) return stats_local;
+	if (reg == &local) {
+		if (posix_memalign((void **)&w, 64, sizeof(struct stats_worker))) return NULL;
+	}
+
+	pthread_once(&worker_once, worker_key_create);
+	reg_lock();
+	if (reg != &local) {
+		w = reg->free;
+		if (!w) {
+			pthread_mutex_unlock(&reg->lock);
+			return NULL;
+		}
+		reg->free = w->next;
+	}
+	memset(w, 0, sizeof(struct stats_worker));
+	w->id   = reg->next_id++;
+	w->pid  = getpid();
+	w->next = reg->workers;
+	if (w->next) w->next->prev = w;
+	reg->workers = w;
+	pthread_mutex_unlock(&reg->lock);
+	pthread_setspecific(worker_key, w);
+
+	return stats_local = w;
+}
+
+void
+stats_accepted(int fd)
+{
+	stats_add(STAT_CONNS, 1);
+	stats_queued(fd);
+}
+
+void
+stats_queued(int fd)
+{
+	if (fd >= 0 && fd < STATS_MAX_FDS) accept_time[fd] = stats_now();
+}
+
+unsigned long
+stats_dequeued(int fd)
+{
+	unsigned long us;
+
+	if (fd < 0 || fd >= STATS_MAX_FDS || !accept_time[fd]) return 0;
+	us = stats_now() - accept_time[fd];
+	stats_record(STAT_QUEUE, us);
+	accept_time[fd] = 0;
+
+	return us;
+}
+
+void
+stats_request_done(struct http_req *r, unsigned long start)
+{
+	stats_add(STAT_REQS, 1);
+	stats_add(STAT_BYTES, r->resp_hd_len + r->resp_len);
+	stats_record(STAT_SERVICE, stats_now() - start);
+}
+
+int
+stats_share(void)
+{
+	struct stats_registry *s;
+	pthread_mutexattr_t attr;
+	size_t sz = sizeof(struct stats_registry) +
+		    STATS_SHARED_BLOCKS * sizeof(struct stats_worker);
+	int i;
+
+	/* their blocks would be on the wrong list */
+	if (local.workers) return -1;
+
+	s = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (s == MAP_FAILED) return -1;
+
+	if (pthread_mutexattr_init(&attr) ||
+	    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ||
+	    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) ||
+	    pthread_mutex_init(&s->lock, &attr)) {
+		munmap(s, sz);
+		return -1;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	/* mmap zeroed the rest */
+	for (i = 0; i < STATS_SHARED_BLOCKS; i++) {
+		s->blocks[i].next = s->free;
+		s->free           = &s->blocks[i];
+	}
+
+	reg = s;
+
+	return 0;
+}
+
+void
+stats_reap(pid_t pid)
+{
+	struct stats_worker *w, *next;
+
+	if (reg == &local) return;
+
+	reg_lock();
+	for (w = reg->workers; w; w = next) {
+		next = w->next;
+		if (w->pid == pid) worker_retire(w);
+	}
+	pthread_mutex_unlock(&reg->lock);
+}
+
+void
+stats_set_queue_depth(unsigned long (*fn)(void))
+{
+	queue_depth = fn;
+}
+
+static unsigned long
+hist_count(unsigned long *hist)
+{
+	unsigned long n = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) n += hist[i];
+	return n;
+}
+
+static unsigned long
+hist_max(unsigned long *hist)
+{
+	int i;
+
+	for (i = HIST_BUCKETS - 1; i > 0; i--) {
+		if (hist[i]) return hist_value(i);
+	}
+	return 0;
+}
+
+static void
+print_counters(FILE *f, struct stats_worker *w, int json)
+{
+	int i;
+
+	for (i = 0; i < STAT_NCOUNTERS; i++) {
+		if (json) fprintf(f, "%s\"%s\": %lu", i ? ", " : "", counter_names[i], w->counters[i]);
+		else      fprintf(f, " %s %lu", counter_names[i], w->counters[i]);
+	}
+}
+
+static void
+print_hist(FILE *f, int h, unsigned long *hist, int json)
+{
+	static const double pcts[] = { 0.5, 0.9, 0.99, 0.999 };
+	static const char *pct_names[] = { "p50", "p90", "p99", "p999" };
+	unsigned long n = hist_count(hist);
+	int i;
+
+	if (json) fprintf(f, ",\n  \"%s\": {\"count\": %lu", hist_names[h], n);
+	else      fprintf(f, "%s count %lu", hist_names[h], n);
+	for (i = 0; i < 4; i++) {
+		unsigned long v = hist_percentile(hist, n, pcts[i]);
+
+		if (json) fprintf(f, ", \"%s\": %lu", pct_names[i], v);
+		else      fprintf(f, " %s %lu", pct_names[i], v);
+	}
+	if (json) fprintf(f, ", \"max\": %lu}", hist_max(hist));
+	else      fprintf(f, " max %lu\n", hist_max(hist));
+}
+
+/*
+ * Sum up all blocks, and format the totals, the histograms and each
+ * live thread's counters.
+ */
+static char *
+stats_format(int json, size_t *len)
+{
+	struct stats_worker *total, *w;
+	unsigned long depth;
+	char *buf = NULL;
+	FILE *f;
+	int i;
+
+	total = malloc(sizeof(struct stats_worker));
+	if (!total) return NULL;
+	f = open_memstream(&buf, len);
+	if (!f) {
+		free(total);
+		return NULL;
+	}
+
+	/* the gauge may take the server's own locks: not under ours */
+	depth = queue_depth ? queue_depth() : 0;
+
+	reg_lock();
+	memcpy(total, &reg->retired, sizeof(struct stats_worker));
+	for (w = reg->workers; w; w = w->next) worker_add(total, w);
+
+	fprintf(f, json ? "{\n  " : "total:");
+	print_counters(f, total, json);
+	if (json) fprintf(f, ",\n  \"queue_depth\": ");
+	else      fprintf(f, "\nqueue_depth ");
+	if (queue_depth) fprintf(f, "%lu", depth);
+	else             fprintf(f, json ? "null" : "-");
+	if (!json) fprintf(f, "\n");
+
+	for (i = 0; i < STAT_NHISTS; i++) print_hist(f, i, total->hists[i], json);
+
+	if (json) fprintf(f, ",\n  \"workers\": [");
+	for (w = reg->workers; w; w = w->next) {
+		if (json) {
+			fprintf(f, "%s\n    {\"id\": %d, \"pid\": %d, ",
+				w == reg->workers ? "" : ",", w->id, (int)w->pid);
+			print_counters(f, w, json);
+			fprintf(f, "}");
+		} else {
+			fprintf(f, "worker %d (pid %d):", w->id, (int)w->pid);
+			print_counters(f, w, json);
+			fprintf(f, "\n");
+		}
+	}
+	if (json) fprintf(f, "\n  ]\n}\n");
+	pthread_mutex_unlock(&reg->lock);
+
+	free(total);
+	if (fclose(f)) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+int
+stats_path(char *path)
+{
+	return !strcmp(path, STATS_PATH) || !strcmp(path, STATS_PATH_JSON);
+}
+
+int
+stats_respond(struct http_req *r)
+{
+	int json = !strcmp(r->path, STATS_PATH_JSON);
+	size_t len;
+	char *buf;
+
+	buf = stats_format(json, &len);
+	if (!buf) {
+		/* fall back to a short answer */
+		buf = r->resp_buf;
+		len = snprintf(buf, MAX_RESP_BUF_SZ, "stats unavailable\n");
+	}
+	/* freed along with the request */
+	return shttp_alloc_response_head(r, buf, len, NULL);
+}
@@ -0,0 +1,135 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <time.h>
+#include <sys/types.h>
+
+#include <hist.h>
+#include <simple_http.h>
+
+/* Reserved paths answered with the stats, as text and as JSON */
+#define STATS_PATH      "__stats"
+#define STATS_PATH_JSON "__stats.json"
+
+typedef enum {
+	STAT_CONNS,     /* connections accepted */
+	STAT_REQS,      /* responses written out */
+	STAT_BYTES,     /* of those responses, heads included */
+	STAT_NOT_FOUND, /* answered with the error page */
+	STAT_ERRORS,    /* malformed requests and failed writes */
+	STAT_SHED,      /* connections turned away with a 503 */
+	STAT_NCOUNTERS,
+} stat_counter_t;
+
+typedef enum {
+	STAT_QUEUE,   /* accept to a worker picking the connection up */
+	STAT_SERVICE, /* a request's start to its response being out */
+	STAT_NHISTS,
+} stat_hist_t;
+
+/*
+ * Every thread counts into its own block, on cache lines of its own,
+ * so counting is a plain add with no atomic instruction or lock.  The
+ * blocks are only summed up when the stats are asked for.
+ */
+struct stats_worker {
+	unsigned long        counters[STAT_NCOUNTERS];
+	unsigned long        hists[STAT_NHISTS][HIST_BUCKETS]; /* in us */
+
+	int                  id;
+	pid_t                pid;
+	struct stats_worker *next, *prev;
+} __attribute__((aligned(64)));
+
+extern __thread struct stats_worker *stats_local;
+
+/* The calling thread's block, set up on its first use */
+struct stats_worker *stats_worker_get(void);
+
+/*
+ * The reader may see a count one behind, but never a torn one: the
+ * owner is the only writer, so a relaxed load and store will do.
+ */
+static inline void
+stats_add(stat_counter_t c, unsigned long n)
+{
+	struct stats_worker *w = stats_local ? stats_local : stats_worker_get();
+
+	if (!w) return;
+	__atomic_store_n(&w->counters[c], w->counters[c] + n, __ATOMIC_RELAXED);
+}
+
+static inline void
+stats_record(stat_hist_t h, unsigned long us)
+{
+	struct stats_worker *w = stats_local ? stats_local : stats_worker_get();
+	unsigned long *b;
+
+	if (!w) return;
+	b = &w->hists[h][hist_index(us)];
+	__atomic_store_n(b, *b + 1, __ATOMIC_RELAXED);
+}
+
+/* Microseconds on the monotonic clock */
+static inline unsigned long
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/*
+ * The acceptor took fd: count it, and note the time, so that the
+ * worker that later picks it up (stats_dequeued) can tell how long it
+ * was queued.
+ */
+void stats_accepted(int fd);
+/* Like stats_accepted, for a connection queued again after going idle */
+void stats_queued(int fd);
+/* Return the microseconds fd was queued, or 0 if it wasn't timed */
+unsigned long stats_dequeued(int fd);
+
+/* r's response, started at start (stats_now), is all out */
+void stats_request_done(struct http_req *r, unsigned long start);
+
+/*
+ * Report the depth of the queue between the acceptor and the workers
+ * with fn, for the server modes that have one.
+ */
+void stats_set_queue_depth(unsigned long (*fn)(void));
+
+/*
+ * Keep the stats in memory shared with the processes forked from now
+ * on, so that each answers with the totals of all of them.  Must be
+ * called before any thread has counted anything.  Threads that start
+ * counting once every shared block is taken aren't counted.  Return -1
+ * on error.
+ */
+int stats_share(void);
+
+/*
+ * Process pid died: fold its threads' counts into the totals, and free
+ * their blocks.
+ */
+void stats_reap(pid_t pid);
+
+/* Is path one of the reserved ones? */
+int stats_path(char *path);
+
+/*
+ * Make the stats, summed up over all threads, the response to r (for
+ * a reserved path).  Return -1 on error.
+ */
+int stats_respond(struct http_req *r);
+
+#endif
@@ -0,0 +1,682 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <server.h>
+#include <simple_http.h>
+#include <util.h>
+#include <pool.h>
+#include <stats.h>
+#include <disk_pool.h>
+#include <uring.h>
+
+/* Submission queue slots; the completion queue is twice as large */
+#define URING_ENTRIES 256
+/* Failed accepts in a row, with nothing accepted, before giving up */
+#define URING_ACCEPT_ERRORS 16
+/* Files that aren't cached are read and sent this much at a time */
+#define URING_CHUNK_SZ (64 * 1024)
+
+/*
+ * There is no liburing here, so we talk to the kernel directly: the
+ * submission and completion queues are rings shared with the kernel
+ * through mmap, and io_uring_enter submits what we queued and waits
+ * for completions.
+ */
+struct uring {
+	int                  fd;
+
+	/* submission queue */
+	unsigned int        *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int         sq_pending; /* queued, not yet submitted */
+
+	/* completion queue */
+	unsigned int        *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void                *sq_ring, *cq_ring;
+	size_t               sq_ring_sz, cq_ring_sz, sqes_sz;
+};
+
+/*
+ * Per-connection state, as in event.c: READING until a whole request
+ * head has arrived, then WRITING until the response is out, with a
+ * stop at DISK while the disk pool works on the response.  Exactly
+ * one operation (op) is in flight for a connection at any time,
+ * except at DISK, where there is none, and its completion carries the
+ * connection as user_data.
+ */
+typedef enum {
+	UCONN_READING,
+	UCONN_DISK,
+	UCONN_WRITING,
+} uconn_state_t;
+
+typedef enum {
+	UOP_RECV,  /* into in.buf */
+	UOP_READ,  /* the next chunk of the file */
+	UOP_WRITE, /* (the rest of) the head and body */
+} uconn_op_t;
+
+struct uconn {
+	uconn_state_t    state;
+	uconn_op_t       op;
+
+	/* READING: the bytes received so far (and the fd) */
+	struct http_conn in;
+	int              eof; /* the client is done sending */
+
+	/* WRITING: the request/response, and how much of it went out */
+	struct http_req *r;
+	off_t            sent;
+	unsigned long    start; /* when the request arrived */
+	struct iovec     iov[2];
+	/* the part of the file (at file offset chunk_off) read so far */
+	char            *chunk;
+	off_t            chunk_off;
+	int              chunk_len;
+
+	struct disk_job  job;
+
+	/* when the head coming in has to be complete, and what's left */
+	time_t                   head_deadline;
+	struct __kernel_timespec timeout;
+};
+
+struct uring_loop {
+	struct uring             ring;
+	int                      accept_fd, multishot;
+	int                      accept_errors; /* in a row */
+	/* how long a connection may take to send its next request */
+	struct __kernel_timespec idle;
+	/* how long a write may take to make progress */
+	struct __kernel_timespec io;
+	/* responses back from the disk pool */
+	struct disk_done         done;
+};
+
+/*
+ * Completions with these user_data are those of the listen socket,
+ * and of the poll on the disk pool's eventfd; those with none (0) are
+ * of linked timeouts and closes, and need no handling.
+ */
+static char listen_marker, disk_marker;
+
+static struct pool_type uconn_pool = POOL_TYPE("uring conn", sizeof(struct uconn));
+static struct pool_type chunk_pool = POOL_TYPE("uring chunk", URING_CHUNK_SZ);
+
+/* Every operation the loop submits */
+static const int uring_ops[] = {
+	IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_READ, IORING_OP_WRITEV,
+	IORING_OP_LINK_TIMEOUT, IORING_OP_POLL_ADD, IORING_OP_CLOSE,
+};
+
+/* 
+ * Return 0 if the kernel of the ring fd supports all of uring_ops.
+ * Those without IORING_REGISTER_PROBE (before 5.6) lack some of them
+ * anyway, and would fail each one with -EINVAL.
+ */
+static int
+uring_probe(int fd)
+{
+	struct io_uring_probe *probe;
+	size_t sz = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	unsigned int i;
+	int ret = 0;
+
+	probe = calloc(1, sz);
+	if (!probe) return -1;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		free(probe);
+		return -1;
+	}
+	for (i = 0; i < sizeof(uring_ops) / sizeof(uring_ops[0]); i++) {
+		int op = uring_ops[i];
+
+		if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+			printf("io_uring: the kernel lacks operation %d\n", op);
+			ret = -1;
+		}
+	}
+	free(probe);
+	if (ret) errno = EOPNOTSUPP;
+	return ret;
+}
+
+static int
+uring_setup(struct uring *u, unsigned int entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(u, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0) return -1;
+	if (uring_probe(u->fd)) goto err_close;
+
+	u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_sz    = p.sq_entries * sizeof(struct io_uring_sqe);
+	/* newer kernels map both rings with one mmap */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_sz > u->sq_ring_sz) u->sq_ring_sz = u->cq_ring_sz;
+		u->cq_ring_sz = 0;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) goto err_close;
+	if (u->cq_ring_sz) {
+		u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) goto err_sq;
+	} else {
+		u->cq_ring = u->sq_ring;
+	}
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) goto err_cq;
+
+	sq = u->sq_ring;
+	u->sq_head  = (unsigned int *)(sq + p.sq_off.head);
+	u->sq_tail  = (unsigned int *)(sq + p.sq_off.tail);
+	u->sq_mask  = (unsigned int *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	cq = u->cq_ring;
+	u->cq_head  = (unsigned int *)(cq + p.cq_off.head);
+	u->cq_tail  = (unsigned int *)(cq + p.cq_off.tail);
+	u->cq_mask  = (unsigned int *)(cq + p.cq_off.ring_mask);
+	u->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+err_cq:
+	if (u->cq_ring_sz) munmap(u->cq_ring, u->cq_ring_sz);
+err_sq:
+	munmap(u->sq_ring, u->sq_ring_sz);
+err_close:
+	close(u->fd);
+	return -1;
+}
+
+static void
+uring_teardown(struct uring *u)
+{
+	munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ring_sz) munmap(u->cq_ring, u->cq_ring_sz);
+	munmap(u->sq_ring, u->sq_ring_sz);
+	close(u->fd);
+}
+
+/*
+ * Hand everything queued to the kernel, and wait for at least
+ * min_complete completions.  Return -1 on error.
+ */
+static int
+uring_enter(struct uring *u, unsigned int min_complete)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, u->fd, u->sq_pending, min_complete,
+			      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) return -1;
+	u->sq_pending -= ret;
+
+	return 0;
+}
+
+/*
+ * Make sure there are n free submission slots.  Only if the queue is
+ * full does this have to submit what is queued to make room.
+ */
+static int
+uring_reserve(struct uring *u, unsigned int n)
+{
+	unsigned int size = *u->sq_mask + 1;
+
+	while (*u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > size - n) {
+		if (uring_enter(u, 0)) return -1;
+	}
+	return 0;
+}
+
+/* The next free submission slot, cleared. */
+static struct io_uring_sqe *
+uring_get_sqe(struct uring *u)
+{
+	unsigned int tail = *u->sq_tail, mask = *u->sq_mask;
+	struct io_uring_sqe *sqe;
+
+	if (uring_reserve(u, 1)) return NULL;
+
+	sqe = &u->sqes[tail & mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	u->sq_array[tail & mask] = tail & mask;
+	/*
+	 * Without SQPOLL the kernel only looks at the queue in
+	 * io_uring_enter, so the caller can fill the sqe in after this.
+	 */
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->sq_pending++;
+
+	return sqe;
+}
+
+static void
+uring_prep(struct io_uring_sqe *sqe, int op, int fd, void *addr,
+	   unsigned int len, unsigned long long off, void *data)
+{
+	sqe->opcode    = op;
+	sqe->fd        = fd;
+	sqe->addr      = (unsigned long)addr;
+	sqe->len       = len;
+	sqe->off       = off;
+	sqe->user_data = (unsigned long)data;
+}
+
+static int
+accept_submit(struct uring_loop *l)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&l->ring);
+
+	if (!sqe) return -1;
+	uring_prep(sqe, IORING_OP_ACCEPT, l->accept_fd, NULL, 0, 0, &listen_marker);
+	/* keep accepting, with one completion per connection */
+	if (l->multishot) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+
+	return 0;
+}
+
+/* Close without waiting for it: the completion is ignored. */
+static void
+close_submit(struct uring_loop *l, int fd)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&l->ring);
+
+	if (!sqe) {
+		close(fd);
+		return;
+	}
+	uring_prep(sqe, IORING_OP_CLOSE, fd, NULL, 0, 0, NULL);
+}
+
+static void
+uconn_free(struct uring_loop *l, struct uconn *c)
+{
+	if (c->r) shttp_free_req(c->r);
+	if (c->chunk) pool_free(&chunk_pool, c->chunk);
+	close_submit(l, c->in.fd);
+	server_release();
+	pool_free(&uconn_pool, c);
+}
+
+static time_t
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * A submission slot for a connection's next op, which the caller
+ * prepares, with the timeout ts linked to it if there is one: the op
+ * then completes with -ECANCELED once ts passes.
+ */
+static struct io_uring_sqe *
+uconn_sqe(struct uring_loop *l, struct __kernel_timespec *ts)
+{
+	struct io_uring_sqe *sqe;
+
+	/* the two must go to the kernel together */
+	if (uring_reserve(&l->ring, ts ? 2 : 1)) return NULL;
+	if (!ts) return uring_get_sqe(&l->ring);
+
+	sqe = uring_get_sqe(&l->ring);
+	uring_prep(uring_get_sqe(&l->ring), IORING_OP_LINK_TIMEOUT, -1, ts, 1, 0, NULL);
+	sqe->flags |= IOSQE_IO_LINK;
+
+	return sqe;
+}
+
+/*
+ * Receive more of the request.  Idle between requests, a connection
+ * gets keepalive_timeout; once a head has started (or for the first
+ * one), io_timeout for all of it, however slowly it trickles in.
+ */
+static int
+uconn_recv(struct uring_loop *l, struct uconn *c)
+{
+	struct http_conn *in = &c->in;
+	struct __kernel_timespec *ts = NULL;
+	struct io_uring_sqe *sqe;
+
+	if (!in->len && in->served) {
+		if (keepalive_timeout) ts = &l->idle;
+	} else if (io_timeout) {
+		time_t now = now_sec();
+
+		if (!c->head_deadline) c->head_deadline = now + io_timeout;
+		c->timeout.tv_sec  = c->head_deadline > now ? c->head_deadline - now : 0;
+		c->timeout.tv_nsec = 0;
+		ts = &c->timeout;
+	}
+
+	sqe = uconn_sqe(l, ts);
+	if (!sqe) return -1;
+	uring_prep(sqe, IORING_OP_RECV, in->fd, in->buf + in->len,
+		   MAX_REQ_SZ - in->len, 0, c);
+	c->op = UOP_RECV;
+
+	return 0;
+}
+
+/*
+ * Queue the next step of writing the response: reading the next
+ * chunk of the file if the body comes from one and we've sent all we
+ * have of it, or else writing the rest of the head along with what
+ * we have of the body.
+ */
+static int
+uconn_write(struct uring_loop *l, struct uconn *c)
+{
+	struct http_req *r = c->r;
+	struct io_uring_sqe *sqe;
+	off_t body_sent;
+	int cnt = 0;
+
+	body_sent = c->sent > r->resp_hd_len ? c->sent - r->resp_hd_len : 0;
+
+	if (r->resp_fd >= 0 && body_sent < r->resp_len &&
+	    body_sent >= c->chunk_off + c->chunk_len) {
+		off_t len = r->resp_len - body_sent;
+
+		if (!c->chunk && !(c->chunk = pool_alloc(&chunk_pool))) return -1;
+		if (len > URING_CHUNK_SZ) len = URING_CHUNK_SZ;
+		c->chunk_off = body_sent;
+		c->chunk_len = 0;
+
+		sqe = uring_get_sqe(&l->ring);
+		if (!sqe) return -1;
+		uring_prep(sqe, IORING_OP_READ, r->resp_fd, c->chunk, len,
+			   r->resp_off + body_sent, c);
+		c->op = UOP_READ;
+
+		return 0;
+	}
+
+	if (c->sent < r->resp_hd_len) {
+		c->iov[cnt].iov_base = r->resp_head + c->sent;
+		c->iov[cnt].iov_len  = r->resp_hd_len - c->sent;
+		cnt++;
+	}
+	if (r->resp_fd >= 0 && body_sent < c->chunk_off + c->chunk_len) {
+		c->iov[cnt].iov_base = c->chunk + body_sent - c->chunk_off;
+		c->iov[cnt].iov_len  = c->chunk_off + c->chunk_len - body_sent;
+		cnt++;
+	} else if (r->resp_fd < 0 && body_sent < r->resp_len) {
+		c->iov[cnt].iov_base = r->response + body_sent;
+		c->iov[cnt].iov_len  = r->resp_len - body_sent;
+		cnt++;
+	}
+
+	/* a client that stops reading is given up on */
+	sqe = uconn_sqe(l, io_timeout ? &l->io : NULL);
+	if (!sqe) return -1;
+	uring_prep(sqe, IORING_OP_WRITEV, r->fd, c->iov, cnt, 0, c);
+	c->op = UOP_WRITE;
+
+	return 0;
+}
+
+/*
+ * Move the connection along until it has an operation in flight:
+ * possibly through several pipelined requests already buffered.
+ * Return -1 if the connection is done or dead.
+ */
+static int
+uconn_advance(struct uring_loop *l, struct uconn *c)
+{
+	int ret;
+
+	while (1) {
+		if (c->state == UCONN_READING) {
+			struct http_conn *in = &c->in;
+			int len = conn_req_len(in);
+
+			/* too large, or cut short: the parser has to make do */
+			if (!len && (in->len == MAX_REQ_SZ || (c->eof && in->len))) {
+				len = in->len;
+			}
+			if (!len) return c->eof ? -1 : uconn_recv(l, c);
+
+			c->start = stats_now();
+			c->head_deadline = 0;
+			c->r = conn_create_req(in, len);
+			if (!c->r) return -1;
+
+			ret = client_get_cached_response(c->r);
+			if (ret > 0 && disk_pool_enabled()) {
+				c->state     = UCONN_DISK;
+				c->job.r     = c->r;
+				c->job.owner = c;
+				disk_submit(&c->job, &l->done);
+				return 0;
+			}
+			if (ret > 0) ret = client_get_file_response(c->r);
+			if (ret) return -1;
+			c->state     = UCONN_WRITING;
+			c->sent      = 0;
+			c->chunk_off = c->chunk_len = 0;
+		}
+
+		if (c->sent < c->r->resp_hd_len + c->r->resp_len) return uconn_write(l, c);
+
+		/* all of the response is out */
+		stats_request_done(c->r, c->start);
+		if (!c->r->keep_alive) return -1;
+		shttp_free_req(c->r);
+		c->r     = NULL;
+		if (c->chunk) pool_free(&chunk_pool, c->chunk);
+		c->chunk = NULL;
+		c->state = UCONN_READING;
+	}
+}
+
+/* The connection's operation completed with res. */
+static void
+uconn_complete(struct uring_loop *l, struct uconn *c, int res)
+{
+	if (res == -EINTR || res == -EAGAIN) {
+		/* try again */
+	} else if (res < 0) {
+		/* includes -ECANCELED: a timeout passed */
+		if (c->op != UOP_RECV) stats_add(STAT_ERRORS, 1);
+		goto done;
+	} else if (c->op == UOP_RECV) {
+		if (res == 0) c->eof = 1;
+		c->in.len += res;
+	} else if (c->op == UOP_READ) {
+		if (res == 0) goto done; /* the file shrank */
+		c->chunk_len = res;
+	} else {
+		c->sent += res;
+	}
+
+	if (!uconn_advance(l, c)) return;
+done:
+	uconn_free(l, c);
+}
+
+/* Wait for the disk pool to hand back responses */
+static int
+disk_poll_submit(struct uring_loop *l)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&l->ring);
+
+	if (!sqe) return -1;
+	uring_prep(sqe, IORING_OP_POLL_ADD, l->done.efd, NULL, 0, 0, &disk_marker);
+	sqe->poll32_events = POLLIN;
+
+	return 0;
+}
+
+/* Carry on with the connections the disk pool is done with */
+static void
+disk_complete(struct uring_loop *l)
+{
+	struct disk_job *j, *next;
+	uint64_t cnt;
+
+	if (read(l->done.efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+		perror("read eventfd");
+	}
+	for (j = disk_done_take(&l->done); j; j = next) {
+		struct uconn *c = j->owner;
+
+		next = j->next;
+		if (j->ret) {
+			uconn_free(l, c);
+			continue;
+		}
+		c->state     = UCONN_WRITING;
+		c->sent      = 0;
+		c->chunk_off = c->chunk_len = 0;
+		if (uconn_advance(l, c)) uconn_free(l, c);
+	}
+	if (disk_poll_submit(l)) perror("io_uring poll");
+}
+
+/* 
+ * Return -1 if accepting keeps failing the same way, rather than
+ * resubmit forever.
+ */
+static int
+accept_complete(struct uring_loop *l, int res, unsigned int flags)
+{
+	struct uconn *c;
+
+	if (res >= 0) {
+		l->accept_errors = 0;
+		stats_add(STAT_CONNS, 1);
+		if (server_admit(res)) {
+			/* turned away with a 503 */
+		} else if (!(c = pool_alloc(&uconn_pool))) {
+			close(res);
+			server_release();
+		} else {
+			server_set_nodelay(res);
+			memset(c, 0, sizeof(struct uconn));
+			c->in.fd = res;
+			c->state = UCONN_READING;
+			if (uconn_advance(l, c)) uconn_free(l, c);
+		}
+	} else if (res == -EINVAL && l->multishot) {
+		/* older kernel: one accept at a time */
+		l->multishot = 0;
+	} else if (res != -EINTR && res != -EAGAIN) {
+		errno = -res;
+		perror("accept");
+		if (res == -EINVAL && ++l->accept_errors >= URING_ACCEPT_ERRORS) return -1;
+	}
+
+	/* a multishot accept that is still armed says so */
+	if (!(flags & IORING_CQE_F_MORE) && accept_submit(l)) {
+		perror("io_uring accept");
+	}
+	return 0;
+}
+
+int
+uring_loop(int accept_fd)
+{
+	struct uring_loop l;
+	struct uring *u = &l.ring;
+	/* if the loop can't get going, the caller can fall back */
+	int ret = -1;
+
+	if (uring_setup(u, URING_ENTRIES)) {
+		perror("io_uring_setup");
+		return -1;
+	}
+	server_raise_fd_limit();
+
+	l.accept_fd    = accept_fd;
+	l.multishot    = 1;
+	l.accept_errors = 0;
+	l.idle.tv_sec  = keepalive_timeout;
+	l.idle.tv_nsec = 0;
+	l.io.tv_sec    = io_timeout;
+	l.io.tv_nsec   = 0;
+	if (accept_submit(&l)) goto done;
+	if (disk_done_init(&l.done)) {
+		perror("eventfd");
+		goto done;
+	}
+	if (disk_poll_submit(&l)) goto done_efd;
+
+	/*
+	 * One system call submits everything the last batch of
+	 * completions queued, and waits for the next batch.
+	 */
+	while (1) {
+		unsigned int head = *u->cq_head;
+
+		/* 
+		 * The completion queue is full (EBUSY), or the kernel is
+		 * short of resources for now (EAGAIN): reap what has
+		 * completed, then try again.
+		 */
+		if (uring_enter(u, 1) && errno != EBUSY && errno != EAGAIN) {
+			perror("io_uring_enter");
+			ret = -2;
+			goto done_efd;
+		}
+
+		while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+			void *data = (void *)(unsigned long)cqe->user_data;
+
+			if (data == &listen_marker) {
+				if (accept_complete(&l, cqe->res, cqe->flags)) {
+					printf("io_uring: accept keeps failing, giving up\n");
+					ret = -1;
+					goto done_efd;
+				}
+			} else if (data == &disk_marker) {
+				disk_complete(&l);
+			} else if (data) {
+				uconn_complete(&l, data, cqe->res);
+			}
+			head++;
+			/* the slot can be reused once the head is past it */
+			__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+		}
+	}
+done_efd:
+	close(l.done.efd);
+done:
+	uring_teardown(u);
+	return ret;
+}
@@ -0,0 +1,24 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef URING_H
+#define URING_H
+
+/*
+ * Serve every connection accepted on accept_fd from a single thread,
+ * like event_loop, but with accepts, receives, file reads, sends and
+ * closes all submitted to and completed through one io_uring, many
+ * at a time per system call.  Return -1 straight away if the kernel
+ * doesn't support io_uring, or any of the operations used (so the
+ * caller can fall back to event_loop), or later if accepting keeps
+ * failing with -EINVAL.  Return -2 if io_uring_enter fails for good,
+ * which is fatal: the connections being served are lost.
+ */
+int uring_loop(int accept_fd);
+
+#endif
@@ -10,132 +10,498 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 
 #include <server.h>
 #include <simple_http.h>
 #include <content.h>
+#include <content_cache.h>
+#include <pack.h>
+#include <stats.h>
+#include <util.h>
 
 /* 
- * newfd_create_req and respond_and_free_req functions are there to
+ * newfd_create_req and write_and_free_req functions are there to
  * help you.  They are utility functions that hide some of the
  * complications of reading and writing to the file descriptors.
  * Hopefully you won't have to modify these two functions (or any of
  * the functions in simple_http, server, and content).
  */
 
+/* Seconds an idle persistent connection is kept open; 0 disables them */
+int keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+/* Seconds for a request head to arrive, and for a write to make progress */
+int io_timeout = DEFAULT_IO_TIMEOUT;
+/* Milliseconds a connection may be queued; 0 for as long as it takes */
+int queue_budget;
+
+#define PARK_MAX_FDS 65536
+#define PARK_EVENTS  64
+
+/* 
+ * Idle persistent connections of modes 1-3, 7 and 8 wait for their
+ * next request on the acceptor's epoll set, rather than in a worker's
+ * read.  They are listed in the order they were parked: as they all
+ * share one timeout, the ones at the head are the first to expire.
+ */
+static int park_epfd = -1;
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static int park_head = -1, park_tail = -1;
+static int park_prev[PARK_MAX_FDS], park_next[PARK_MAX_FDS];
+static unsigned long park_since[PARK_MAX_FDS]; /* 0 if not parked */
+/* the acceptor's own: those of the last epoll_wait's events yet to be seen */
+static struct epoll_event park_events[PARK_EVENTS];
+static int park_nevents, park_at;
+
 /* 
- * Read data off of the new file descriptor (returned from
- * server_accept), and create a http_req object.  This struct
- * describes the request being made, including the path that is
- * requested (r->path).
+ * Split the first len bytes (a request head) off of the connection's
+ * buffer, and create a http_req object for them.  Whatever follows
+ * is kept in the buffer: it is the start of the next request.
+ * Return NULL if the request is malformed.
  */
-#define MAX_REQ_SZ 1024
 struct http_req *
-newfd_create_req(int new_fd)
+conn_create_req(struct http_conn *conn, int len)
 {
 	struct http_req *r;
-	char *data;
-	int amnt;
-
-	data = malloc(MAX_REQ_SZ * sizeof(char));
-	if (!data) return NULL;
+	int complete;
 
-	amnt = read(new_fd, data, MAX_REQ_SZ);
-	if (amnt < 0) {
-		perror("read off of new file descriptor");
-		free(data);
-		return NULL;
-	}
+	/* did the head end properly, so we know where the next starts? */
+	complete = conn->parser.head_len == len;
 
-	r = shttp_alloc_req(new_fd, data);
+	r = shttp_alloc_req(conn->fd, conn->buf, len);
+	conn->len -= len;
+	memmove(conn->buf, conn->buf + len, conn->len);
+	/* the next head starts afresh at the front of the buffer */
+	memset(&conn->parser, 0, sizeof(struct shttp_parser));
+	conn->served++;
 	if (!r) {
 		printf("Could not allocate request\n");
-		free(data);
 		return NULL;
 	}
-	if (shttp_get_path(r)) {
-		data[amnt] = '\0';
-		printf("Incorrectly formatted HTTP request:\n\t%s\n", data);
+
+	if (shttp_parse_req(r)) {
+		stats_add(STAT_ERRORS, 1);
+		printf("Incorrectly formatted HTTP request:\n\t%s\n", r->request);
 		shttp_free_req(r);
 		return NULL;
 	}
+	if (!complete || !keepalive_timeout) r->keep_alive = 0;
+
 	return r;
 }
 
+static long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
 /* 
- * Once a request has been formulated (of type char *, with length
- * len), then we want to write it out to the client through the file
- * descriptor.  This function will do that, and when it is done, it
- * will free the request structure, and all memory associated with it.
+ * Read data off of the connection's file descriptor (returned from
+ * server_accept) until a whole request has arrived, and create a
+ * http_req object.  This struct describes the request being made,
+ * including the path that is requested (r->path).  Requests that were
+ * pipelined behind it stay buffered in conn.  Return NULL if the
+ * connection is closed, idle for too long, or the request is bad.
+ * Between requests, a client may be idle for keepalive_timeout; the
+ * first request, and any once it has started, must be in within
+ * io_timeout, however slowly it trickles in.
  */
-void 
-respond_and_free_req(struct http_req *r, char *response, int len)
+struct http_req *
+newfd_create_req(struct http_conn *conn)
 {
-	int amnt_written = 0;
+	long deadline = 0;
+	int len, amnt;
 
-	if (shttp_alloc_response_head(r, response, len)) {
-		printf("Could not formulate HTTP response\n");
-		shttp_free_req(r);
-		return;
+	while (!(len = conn_req_len(conn))) {
+		struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+		int timeout = -1;
+
+		/* too large: the parser will have to make do */
+		if (conn->len == MAX_REQ_SZ) {
+			len = conn->len;
+			break;
+		}
+
+		if (!conn->len && conn->served) {
+			if (keepalive_timeout) timeout = keepalive_timeout * 1000;
+		} else if (io_timeout) {
+			if (!deadline) deadline = now_ms() + io_timeout * 1000L;
+			timeout = deadline - now_ms();
+			if (timeout < 0) timeout = 0;
+		}
+		if (timeout >= 0 && poll(&pfd, 1, timeout) == 0) return NULL;
+
+		amnt = read(conn->fd, conn->buf + conn->len, MAX_REQ_SZ - conn->len);
+		if (amnt < 0) {
+			if (errno == EINTR || errno == EAGAIN) continue;
+			if (errno != ECONNRESET) perror("read off of new file descriptor");
+			return NULL;
+		}
+		if (amnt == 0) {
+			/* the client is done sending: serve what we have */
+			if (!conn->len) return NULL;
+			len = conn->len;
+			break;
+		}
+		conn->len += amnt;
 	}
 
+	return conn_create_req(conn, len);
+}
+
+int
+client_write_response(struct http_req *r, off_t *sent)
+{
+	off_t total = r->resp_hd_len + r->resp_len;
+	/* an empty file is just the head */
+	int file = r->resp_fd >= 0 && r->resp_len > 0;
+
+	while (*sent < total) {
+		ssize_t ret;
+
+		if (file && *sent >= r->resp_hd_len) {
+			/* the kernel copies the file from the page cache */
+			off_t off = r->resp_off + *sent - r->resp_hd_len;
+
+			ret = sendfile(r->fd, r->resp_fd, &off, total - *sent);
+			if (ret == 0) return -1; /* the file shrank */
+		} else if (file) {
+			/* hold the head back until the file can go with it */
+			ret = send(r->fd, r->resp_head + *sent, 
+				   r->resp_hd_len - *sent, MSG_MORE);
+		} else {
+			/* head and body in one system call */
+			struct iovec iov[2];
+			int cnt = 0;
+
+			if (*sent < r->resp_hd_len) {
+				iov[cnt].iov_base = r->resp_head + *sent;
+				iov[cnt].iov_len  = r->resp_hd_len - *sent;
+				cnt++;
+			}
+			if (r->resp_len) {
+				off_t off = *sent > r->resp_hd_len ? *sent - r->resp_hd_len : 0;
+
+				iov[cnt].iov_base = r->response + off;
+				iov[cnt].iov_len  = r->resp_len - off;
+				cnt++;
+			}
+			ret = writev(r->fd, iov, cnt);
+		}
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		*sent += ret;
+	}
+	return 1;
+}
+
+/* 
+ * Write the response head and body already attached to r out to the
+ * client, then free the request structure, and all memory associated
+ * with it.  start is when work on the request started, for the
+ * stats.  Return 1 if the connection can carry another request.
+ */
+static int 
+write_and_free_req(struct http_req *r, unsigned long start)
+{
+	off_t sent = 0;
+	int keep_alive = 0, ret;
+
 	/* 
 	 * At this point, we have the response, and the http head to
-	 * reply with.  Write them out to the client!
+	 * reply with.  Write them out to the client!  If the socket
+	 * doesn't block, wait for room whenever it is full, but no longer
+	 * than io_timeout at a time.
 	 */
-	while (amnt_written != r->resp_hd_len) {
-		int ret = write(r->fd, r->resp_head + amnt_written, 
-				r->resp_hd_len - amnt_written);
-		if (ret < 0) {
-			printf("Could not write the response to the fd\n");
-			goto done;
+	while ((ret = client_write_response(r, &sent)) == 0) {
+		struct pollfd pfd = { .fd = r->fd, .events = POLLOUT };
+
+		if (poll(&pfd, 1, io_timeout * 1000) <= 0) break;
+	}
+	if (ret > 0) {
+		keep_alive = r->keep_alive;
+		stats_request_done(r, start);
+	} else {
+		stats_add(STAT_ERRORS, 1);
+		printf("Could not write the response to the fd\n");
+	}
+	shttp_free_req(r);
+
+	return keep_alive;
+}
+
+int
+client_get_cached_response(struct http_req *r)
+{
+	/* the server's own stats, ahead of any file of that name */
+	if (stats_path(r->path)) return stats_respond(r);
+
+	/* parts of files are cut straight out of the file */
+	if (!r->head.range.p) {
+		/* a compressed variant, if the client takes one and we have it */
+		if (!content_cache_respond_encoded(r)) return 0;
+
+		/* with a preloaded pack, (almost) every file is in memory */
+		if (!pack_respond(r)) return 0;
+	}
+
+	/* hot files are answered straight out of memory */
+	if (!shttp_conditional(r) && !r->head.range.p && !content_cache_lookup(r)) return 0;
+
+	return 1;
+}
+
+int
+client_get_file_response(struct http_req *r)
+{
+	struct shttp_validator v, *valid = NULL;
+	struct stat st;
+	char *response;
+	off_t len, start, part;
+	int content_fd;
+
+	/* a client whose copy is still good needn't have the file read */
+	if (shttp_conditional(r) && !content_stat(r->path, &st)) {
+		shttp_validator(&v, &st);
+		if (shttp_not_modified(r, &v)) return shttp_alloc_not_modified(r, &v);
+	}
+
+	/* read the file into the cache, to answer the next ones from memory */
+	if (!r->head.range.p && !content_cache_respond(r)) return 0;
+
+	/* everything else is streamed straight from the page cache */
+	if (!content_open(r->path, &content_fd, &len, &st)) {
+		r->resp_fd = content_fd;
+		response   = NULL;
+		valid      = &v;
+		shttp_validator(valid, &st);
+
+		switch (shttp_range(r, valid, len, &start, &part)) {
+		case 1:
+			return shttp_alloc_partial_head(r, start, part, len, valid);
+		case -1:
+			/* the 416 has no body: nothing to send from the file */
+			close(r->resp_fd);
+			r->resp_fd = -1;
+			return shttp_alloc_bad_range(r, len);
 		}
-		amnt_written += ret;
+	} else {
+		response = r->resp_buf;
+		len      = content_error(r->path, r->resp_buf, MAX_RESP_BUF_SZ);
+		stats_add(STAT_NOT_FOUND, 1);
 	}
-	
-	amnt_written = 0;
-	while (amnt_written != r->resp_len) {
-		int ret = write(r->fd, r->response + amnt_written, 
-				r->resp_len - amnt_written);
-		if (ret < 0) {
-			printf("Could not write the response to the fd\n");
-			goto done;
+
+	if (shttp_alloc_response_head(r, response, len, valid)) {
+		printf("Could not formulate HTTP response\n");
+		return -1;
+	}
+	return 0;
+}
+
+int
+client_get_response(struct http_req *r)
+{
+	int ret = client_get_cached_response(r);
+
+	if (ret <= 0) return ret;
+	return client_get_file_response(r);
+}
+
+/* Take fd off of the list of parked connections; park_lock is held */
+static void
+park_unlink(int fd)
+{
+	if (park_prev[fd] >= 0) park_next[park_prev[fd]] = park_next[fd];
+	else                    park_head = park_next[fd];
+	if (park_next[fd] >= 0) park_prev[park_next[fd]] = park_prev[fd];
+	else                    park_tail = park_prev[fd];
+	park_since[fd] = 0;
+}
+
+/* 
+ * Hand the idle connection fd over to the acceptor (client_next) to
+ * wait for its next request.  Return -1, and leave fd to the caller,
+ * if no acceptor takes them, or if the request is already in.
+ */
+static int
+client_park(int fd)
+{
+	struct pollfd pending = { .fd = fd, .events = POLLIN };
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.fd = fd };
+	int epfd = __atomic_load_n(&park_epfd, __ATOMIC_ACQUIRE);
+	int ret = 0;
+
+	if (epfd < 0 || fd >= PARK_MAX_FDS) return -1;
+	if (poll(&pending, 1, 0) > 0) return -1;
+
+	pthread_mutex_lock(&park_lock);
+	park_since[fd] = stats_now();
+	park_next[fd]  = -1;
+	park_prev[fd]  = park_tail;
+	if (park_tail >= 0) park_next[park_tail] = fd;
+	else                park_head = fd;
+	park_tail = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		park_unlink(fd);
+		ret = -1;
+	}
+	pthread_mutex_unlock(&park_lock);
+
+	return ret;
+}
+
+/* 
+ * Close the parked connections idle for keepalive_timeout.  Return
+ * the milliseconds until the next one is due to be, or -1 if none
+ * are parked.
+ */
+static int
+client_expire(void)
+{
+	unsigned long now = stats_now(), idle = keepalive_timeout * 1000000UL;
+	int fd, ms = -1;
+
+	pthread_mutex_lock(&park_lock);
+	while ((fd = park_head) >= 0 && now - park_since[fd] >= idle) {
+		park_unlink(fd);
+		epoll_ctl(park_epfd, EPOLL_CTL_DEL, fd, NULL);
+		close(fd);
+		server_release();
+	}
+	if (fd >= 0) ms = (park_since[fd] + idle - now) / 1000 + 1;
+	pthread_mutex_unlock(&park_lock);
+
+	return ms;
+}
+
+int
+client_next(int accept_fd, int wait)
+{
+	struct pollfd pending = { .fd = accept_fd, .events = POLLIN };
+	int fd, parked;
+
+	if (park_epfd < 0) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = accept_fd };
+		int epfd = epoll_create1(0);
+
+		if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, accept_fd, &ev)) {
+			/* no parking, then: idle connections stay with their workers */
+			if (epfd >= 0) close(epfd);
+			if (!wait && poll(&pending, 1, 0) <= 0) return -1;
+			return server_accept(accept_fd);
 		}
-		amnt_written += ret;
+		__atomic_store_n(&park_epfd, epfd, __ATOMIC_RELEASE);
+	}
+
+	while (1) {
+		if (park_at == park_nevents) {
+			/* 
+			 * Only with no events pending, so none of them
+			 * can be for a connection closed here.
+			 */
+			int ms = client_expire();
+
+			park_at      = 0;
+			park_nevents = epoll_wait(park_epfd, park_events, PARK_EVENTS, wait ? ms : 0);
+			if (park_nevents <= 0) {
+				park_nevents = 0;
+				if (!wait) return -1;
+				continue;
+			}
+		}
+
+		fd = park_events[park_at++].data.fd;
+		/* level triggered: reported again while more are waiting */
+		if (fd == accept_fd) return server_accept(accept_fd);
+
+		pthread_mutex_lock(&park_lock);
+		parked = park_since[fd] != 0;
+		if (parked) {
+			park_unlink(fd);
+			epoll_ctl(park_epfd, EPOLL_CTL_DEL, fd, NULL);
+		}
+		pthread_mutex_unlock(&park_lock);
+		if (!parked) continue;
+
+		/* it queues again, for the next request (or the hang-up) */
+		stats_queued(fd);
+		return fd;
 	}
-done:
-	shttp_free_req(r);
-	return;
 }
 
 /* 
- * Process a client request on a newly opened file descriptor.
+ * Process a client request on a newly opened file descriptor, and
+ * any further requests the client sends on the same connection.
+ * Once they are all answered, the connection is handed back to the
+ * acceptor, if it takes them, rather than waited on here.
  */
 void
 client_process(int fd)
 {
+	struct http_conn conn;
 	struct http_req *r;
-	char *response;
-	int len;
+	unsigned long start, waited;
+
+	assert(fd >= 0);
+	/* waited past the budget: it's late already, make way for others */
+	waited = stats_dequeued(fd);
+	if (queue_budget && waited > queue_budget * 1000UL) {
+		server_shed(fd);
+		server_release();
+		return;
+	}
+
+	conn.fd     = fd;
+	conn.len    = 0;
+	conn.served = 0;
+	memset(&conn.parser, 0, sizeof(struct shttp_parser));
+	server_set_nodelay(fd);
+	/* 
+	 * A client that stops reading mustn't hold the thread forever:
+	 * writes don't block, so we can wait for progress with a timeout.
+	 */
+	if (io_timeout) server_set_nonblock(fd);
+
+	/* 
+	 * The first request's service time starts as the connection is
+	 * picked up; the later ones' as they arrive.
+	 */
+	start = stats_now();
 
 	/* 
 	 * This code will be used to get the request and respond to
 	 * it.  This should probably be in the worker
 	 * threads/processes.
 	 */
-	r = newfd_create_req(fd);
-	if (!r || !r->path) {
-		close(fd);
-		return;
-	}
-	assert(r);
-	assert(r->path);
+	while ((r = newfd_create_req(&conn))) {
+		assert(r->path);
 
-	response = content_get(r->path, &len);
-	if (!response) {
-		shttp_free_req(r);
-		return;
+		if (!start) start = stats_now();
+		if (client_get_response(r)) {
+			shttp_free_req(r);
+			break;
+		}
+		if (!write_and_free_req(r, start)) break;
+		start = 0;
+		/* none pipelined: don't hold the thread while it's idle */
+		if (!conn.len && !client_park(fd)) return;
 	}
-
-	respond_and_free_req(r, response, len);
+	close(fd);
+	server_release();
 }
@@ -9,6 +9,86 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <simple_http.h>
+
+/* Default seconds an idle persistent connection is kept open */
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+/* 
+ * Default seconds a client has to send a whole request head, and to
+ * take each piece of the response
+ */
+#define DEFAULT_IO_TIMEOUT 10
+
+extern int keepalive_timeout;
+extern int io_timeout;
+/* Milliseconds a connection may wait for a worker before it gets a 503 */
+extern int queue_budget;
+
+/* 
+ * A client connection, and the bytes read off of it that have yet to
+ * be made into a request.
+ */
+struct http_conn {
+	int  fd;
+	int  len;
+	int  served; /* requests made off of it so far */
+	struct shttp_parser parser; /* how far into buf we've looked */
+	char buf[MAX_REQ_SZ + 1];
+};
+
 void client_process(int fd);
+/* 
+ * For the acceptor of modes 1-3, 7 and 8: return the next connection with
+ * a request for a worker, either a new one off of accept_fd, or an
+ * idle persistent one that has become readable again.  Once this is
+ * called, client_process hands the connections that go idle back to
+ * it, and it closes those idle for keepalive_timeout.  Return -1 if
+ * an accept fails, or, unless wait is set, if none are ready.
+ */
+int client_next(int accept_fd, int wait);
+
+/* 
+ * Return the length of the first complete request head (up to and
+ * including its blank line) in conn's buffer, or 0 if more of it has
+ * yet to arrive.  Only the bytes added since the last call are
+ * scanned.  Anything after the head belongs to the next, pipelined,
+ * request.
+ */
+static inline int
+conn_req_len(struct http_conn *conn)
+{
+	return shttp_parse_len(&conn->parser, conn->buf, conn->len);
+}
+
+/* 
+ * Take the request head of len bytes at the start of conn's buffer
+ * off of it, and parse it into a http_req.  Return NULL if it is
+ * malformed.
+ */
+struct http_req *conn_create_req(struct http_conn *conn, int len);
+
+/* 
+ * Attach the response for r->path to r: from the content cache, as
+ * a file to send, or as the error page.  Return -1 on error.
+ */
+int client_get_response(struct http_req *r);
+
+/* 
+ * client_get_response in two steps.  The first answers r from memory
+ * if it can, and never blocks: it returns 0 if r has its response, 1
+ * if the second step, which goes to the disk and may block for long,
+ * has to answer it, and -1 on error.  The second returns 0, or -1 on
+ * error.
+ */
+int client_get_cached_response(struct http_req *r);
+int client_get_file_response(struct http_req *r);
+
+/* 
+ * Write as much of r's response (head and body) as the socket takes,
+ * starting sent bytes in, and advance sent.  Partial writes are
+ * resumed where they left off.  Return 1 once all of it is out, 0 if
+ * a non-blocking socket is full, and -1 on error.
+ */
+int client_write_response(struct http_req *r, off_t *sent);
 
 #endif
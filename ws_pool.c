@@ -0,0 +1,255 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cas.h>
+#include <futex.h>
+#include <ws_pool.h>
+
+/* How many times to look for work before going to sleep on the futex */
+#define WS_SPIN_LIMIT 128
+/*
+ * How many more connections than the least loaded one a worker may
+ * have queued and still be handed the ones it was asked for
+ */
+#define WS_STEER_SLACK 2
+
+static int
+deque_init(ws_deque_t *d, size_t element_capacity)
+{
+    unsigned long capacity = 2;
+
+    while (capacity < element_capacity) capacity <<= 1;
+
+    d->fds = malloc(capacity * sizeof(int));
+    if (!d->fds) return -1;
+    d->mask = capacity - 1;
+    return 0;
+}
+
+static unsigned long
+deque_size(ws_deque_t *d)
+{
+    unsigned long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    unsigned long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+    return b > t ? b - t : 0;
+}
+
+/*
+ * Only the acceptor pushes, so bottom needs no __cas: the fd is
+ * written first, and then published by moving bottom past it.
+ * Return -1 if the deque is full.
+ */
+static int
+deque_push(ws_deque_t *d, int fd)
+{
+    unsigned long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    unsigned long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+    if (b - t > d->mask) return -1;
+    d->fds[b & d->mask] = fd;
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Owner and thieves alike: read the fd at top, and claim it by moving
+ * top past it.  The slot can't be reused before top has moved, so the
+ * fd we read is the one we claimed.  Return -1 if the deque is empty.
+ */
+static int
+deque_steal(ws_deque_t *d, int *fd)
+{
+    unsigned long t, b;
+
+    while (1) {
+        t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+        b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+        if (t >= b) return -1;
+
+        *fd = d->fds[t & d->mask];
+        if (!__cas(&d->top, t, t + 1)) return 0;
+    }
+}
+
+int
+ws_pool_init(ws_pool_t *pool, int nworkers, size_t capacity)
+{
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->deques = calloc(nworkers, sizeof(ws_deque_t));
+    if (!pool->deques) return -1;
+    pool->nworkers = nworkers;
+
+    for (i = 0; i < nworkers; i++) {
+        if (deque_init(&pool->deques[i], capacity)) return -1;
+    }
+
+    /* spinning only pays off if the other side can run meanwhile */
+    pool->spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? WS_SPIN_LIMIT : 0;
+    return 0;
+}
+
+/*
+ * Wake one sleeper on the futex word, if there is any.  As in
+ * mpmc_ring.c, the fence orders our push/take before the read of the
+ * waiter count: either the sleeper sees our change, or we see it.
+ */
+static inline void
+pool_wake(unsigned int *word, unsigned int *waiters)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED) == 0) return;
+
+    __atomic_fetch_add(word, 1, __ATOMIC_SEQ_CST);
+    futex_wake(word, 1);
+}
+
+/*
+ * The deque with the fewest connections queued, counting the one its
+ * worker may be busy with.  Ties go round-robin.
+ */
+static ws_deque_t *
+least_loaded(ws_pool_t *pool)
+{
+    ws_deque_t *best = NULL;
+    unsigned long best_load = ~0UL;
+    int i;
+
+    for (i = 0; i < pool->nworkers; i++) {
+        ws_deque_t *d = &pool->deques[(pool->next + i) % pool->nworkers];
+        unsigned long load;
+
+        load = deque_size(d) + __atomic_load_n(&d->busy, __ATOMIC_RELAXED);
+        if (load < best_load) {
+            best      = d;
+            best_load = load;
+            if (load == 0) break;
+        }
+    }
+    pool->next = (pool->next + 1) % pool->nworkers;
+
+    return best;
+}
+
+/*
+ * The deque the connection would rather go to, if its load isn't more
+ * than WS_STEER_SLACK past the least loaded one's.
+ */
+static ws_deque_t *
+pick(ws_pool_t *pool, int worker)
+{
+    ws_deque_t *least = least_loaded(pool), *d;
+
+    if (worker < 0 || worker >= pool->nworkers) return least;
+    d = &pool->deques[worker];
+    if (deque_size(d) + __atomic_load_n(&d->busy, __ATOMIC_RELAXED) >
+        deque_size(least) + __atomic_load_n(&least->busy, __ATOMIC_RELAXED) + WS_STEER_SLACK) {
+        return least;
+    }
+    return d;
+}
+
+static int
+try_push(ws_pool_t *pool, int fd, int worker)
+{
+    int i;
+
+    if (!deque_push(pick(pool, worker), fd)) return 0;
+    /* it filled up under us: any deque with room will do */
+    for (i = 0; i < pool->nworkers; i++) {
+        if (!deque_push(&pool->deques[i], fd)) return 0;
+    }
+    return -1;
+}
+
+void
+ws_pool_push(ws_pool_t *pool, int fd, int worker)
+{
+    unsigned int seen;
+    int spins = 0;
+
+    while (try_push(pool, fd, worker)) {
+        if (spins++ < pool->spin_limit) {
+            cpu_relax();
+            continue;
+        }
+
+        /* announce ourselves, then re-check before sleeping */
+        __atomic_fetch_add(&pool->space_waiters, 1, __ATOMIC_SEQ_CST);
+        seen = __atomic_load_n(&pool->space, __ATOMIC_SEQ_CST);
+        if (try_push(pool, fd, worker) == 0) {
+            __atomic_fetch_sub(&pool->space_waiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        futex_wait(&pool->space, seen);
+        __atomic_fetch_sub(&pool->space_waiters, 1, __ATOMIC_SEQ_CST);
+        spins = 0;
+    }
+
+    pool_wake(&pool->work, &pool->work_waiters);
+}
+
+/* Our own deque first, then the others, starting with our neighbour */
+static int
+try_take(ws_pool_t *pool, int worker, int *fd)
+{
+    int i;
+
+    for (i = 0; i < pool->nworkers; i++) {
+        if (!deque_steal(&pool->deques[(worker + i) % pool->nworkers], fd)) return 0;
+    }
+    return -1;
+}
+
+int
+ws_pool_take(ws_pool_t *pool, int worker)
+{
+    ws_deque_t *own = &pool->deques[worker];
+    unsigned int seen;
+    int spins = 0;
+    int fd;
+
+    __atomic_store_n(&own->busy, 0, __ATOMIC_RELAXED);
+
+    while (try_take(pool, worker, &fd)) {
+        if (spins++ < pool->spin_limit) {
+            cpu_relax();
+            continue;
+        }
+
+        __atomic_fetch_add(&pool->work_waiters, 1, __ATOMIC_SEQ_CST);
+        seen = __atomic_load_n(&pool->work, __ATOMIC_SEQ_CST);
+        if (try_take(pool, worker, &fd) == 0) {
+            __atomic_fetch_sub(&pool->work_waiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        futex_wait(&pool->work, seen);
+        __atomic_fetch_sub(&pool->work_waiters, 1, __ATOMIC_SEQ_CST);
+        spins = 0;
+    }
+
+    __atomic_store_n(&own->busy, 1, __ATOMIC_RELAXED);
+    pool_wake(&pool->space, &pool->space_waiters);
+    return fd;
+}
+
+size_t
+ws_pool_size(ws_pool_t *pool)
+{
+    size_t n = 0;
+    int i;
+
+    for (i = 0; i < pool->nworkers; i++) n += deque_size(&pool->deques[i]);
+    return n;
+}
@@ -0,0 +1,78 @@
+/**
+ * Redistribution of this file is permitted under the GNU General
+ * Public License v2.
+ *
+ * Copyright 2013 by Qiyu Li.
+ * Author: Qiyu Li, johnnyli@gwu.edu, 2013
+ */
+
+#ifndef WS_POOL_H
+#define WS_POOL_H
+
+#include <stddef.h>
+
+#define WS_CACHE_LINE 64
+
+/*
+ * A worker's deque of file descriptors, after Chase and Lev: a
+ * circular array with a bottom index that only the acceptor moves
+ * (pushing), and a top index that takers claim with __cas.  The
+ * worker owning the deque takes from the top like any thief does, so
+ * its connections are served in the order they arrived.  Each index
+ * has its own cache line.
+ */
+typedef struct ws_deque_t {
+    int *fds;
+    unsigned long mask; /* capacity - 1, capacity is a power of two */
+
+    unsigned long bottom __attribute__((aligned(WS_CACHE_LINE)));
+
+    unsigned long top __attribute__((aligned(WS_CACHE_LINE)));
+    int busy; /* the owner is serving a connection */
+} __attribute__((aligned(WS_CACHE_LINE))) ws_deque_t;
+
+/*
+ * A deque per worker.  The acceptor hands each connection to the
+ * least loaded worker, and a worker whose deque is empty steals from
+ * the others before it goes to sleep, so a worker stuck on a long
+ * response doesn't hold up the connections queued behind it.
+ */
+typedef struct ws_pool_t {
+    ws_deque_t *deques;
+    int nworkers;
+    int spin_limit; /* tries before parking, 0 on a uniprocessor */
+    int next;       /* where the acceptor starts looking */
+
+    /* futex word bumped when a connection arrives, and its sleepers */
+    unsigned int work __attribute__((aligned(WS_CACHE_LINE)));
+    unsigned int work_waiters;
+
+    /* futex word bumped when a deque has room again, and its sleepers */
+    unsigned int space __attribute__((aligned(WS_CACHE_LINE)));
+    unsigned int space_waiters;
+} ws_pool_t;
+
+/*
+ * Initialize the pool for nworkers workers, each with a deque of room
+ * for at least capacity fds (rounded up to a power of two).  Return 0
+ * on success, -1 otherwise.
+ */
+int ws_pool_init(ws_pool_t *pool, int nworkers, size_t capacity);
+
+/*
+ * Acceptor only: queue fd on worker's deque, unless that one is
+ * falling behind the others, or worker is -1; then on the least loaded
+ * worker's.  Wait while all of them are full.
+ */
+void ws_pool_push(ws_pool_t *pool, int fd, int worker);
+
+/*
+ * Worker only: take the next fd off the worker's own deque, or steal
+ * one from another's, waiting (spin, then futex) if there is none.
+ */
+int ws_pool_take(ws_pool_t *pool, int worker);
+
+/* Number of fds queued on all deques.  Only a snapshot, for the stats. */
+size_t ws_pool_size(ws_pool_t *pool);
+
+#endif